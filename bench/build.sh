@@ -0,0 +1,24 @@
+# 编译 bench 里的测试，要先编译好 FFmpeg(build_decoder_264_265.sh)
+# 运行：node bench/dist/yuv2rgba.js
+
+SHELL_FOLDER=$(cd "$(dirname "$0")"; pwd)
+
+cd ${SHELL_FOLDER}/..
+
+mkdir -p ${SHELL_FOLDER}/dist
+
+# 和 build.sh 一样用 -msimd128，去掉就是测标量版本
+FLAGS=' -O3 -msimd128 '
+
+echo "Running Emscripten..."
+emcc bench/yuv2rgba.c ffmpeg/lib/libavformat.a ffmpeg/lib/libavcodec.a ffmpeg/lib/libavutil.a ffmpeg/lib/libswscale.a \
+    ${FLAGS} \
+    -I "ffmpeg/include" \
+    -s WASM=1 \
+    -s ALLOW_MEMORY_GROWTH=1 \
+    -s USE_PTHREADS=1 \
+    -s ENVIRONMENT=node \
+    -s EXIT_RUNTIME=1 \
+    -o ${SHELL_FOLDER}/dist/yuv2rgba.js
+
+echo "Finished Build"
@@ -0,0 +1,164 @@
+// yuv420p 转 rgba/bgra 的比对和速度测试
+// 1. simd 版本(yuv2rgbaRow)和标量版本(yuv2rgbaRowC)在随机的行上逐位比对，所有系数、rgba/bgra 都测
+// 2. 整帧转换的速度：simd、标量、swscale
+// 编译运行：bench/build.sh && node bench/dist/yuv2rgba.js，比对不一致时返回 1
+#include "../src/decoder3.c"
+
+#define CHECK_ROUNDS	2000	// 每组系数/格式随机测多少行
+#define CHECK_MAX_WIDTH	1037	// 随机宽度的上限，不是 16 的倍数，标量收尾的部分也能测到
+#define GUARD_SIZE		64		// 行尾后面的保护区，检查有没有写越界
+
+static const YuvCoeffs* kCoeffs[] = {
+	&kYuvBT601Limited, &kYuvBT709Limited, &kYuvBT601Full, &kYuvBT709Full, &kYuvBT2020Limited, &kYuvBT2020Full,
+};
+static const char* kCoeffNames[] = {
+	"bt601 limited", "bt709 limited", "bt601 full", "bt709 full", "bt2020 limited", "bt2020 full",
+};
+#define COEFF_COUNT	(int)(sizeof(kCoeffs) / sizeof(kCoeffs[0]))
+
+static uint32_t g_seed = 0x12345678;
+
+// xorshift，结果可复现
+static uint32_t nextRandom(void) {
+	g_seed ^= g_seed << 13;
+	g_seed ^= g_seed >> 17;
+	g_seed ^= g_seed << 5;
+	return g_seed;
+}
+
+static void fillRandom(uint8_t* p, int n) {
+	int i;
+	for (i = 0; i < n; i++) {
+		p[i] = nextRandom() & 0xFF;
+	}
+}
+
+// 返回不一致的行数
+static int checkRows(void) {
+	int cw = (CHECK_MAX_WIDTH + 1) / 2;
+	int rowSize = CHECK_MAX_WIDTH * 4 + GUARD_SIZE;
+	uint8_t* y = malloc(CHECK_MAX_WIDTH);
+	uint8_t* u = malloc(cw);
+	uint8_t* v = malloc(cw);
+	uint8_t* simd = malloc(rowSize);
+	uint8_t* scalar = malloc(rowSize);
+	int bad = 0;
+	int c, bgra, i;
+	for (c = 0; c < COEFF_COUNT; c++) {
+		for (bgra = 0; bgra < 2; bgra++) {
+			int rowBad = 0;
+			for (i = 0; i < CHECK_ROUNDS; i++) {
+				int width = 1 + nextRandom() % CHECK_MAX_WIDTH;
+				fillRandom(y, width);
+				fillRandom(u, (width + 1) / 2);
+				fillRandom(v, (width + 1) / 2);
+				// 偶尔用极端值，测截断
+				if (i % 16 == 0) {
+					memset(y, i & 16 ? 255 : 0, width);
+				}
+				memset(simd, 0xA5, rowSize);
+				memset(scalar, 0xA5, rowSize);
+				yuv2rgbaRow(y, u, v, simd, width, kCoeffs[c], bgra);
+				yuv2rgbaRowC(y, u, v, scalar, 0, width, kCoeffs[c], bgra);
+				if (memcmp(simd, scalar, rowSize) != 0) {
+					if (rowBad == 0) {
+						printf("mismatch: %s %s width %d\n", kCoeffNames[c], bgra ? "bgra" : "rgba", width);
+					}
+					rowBad++;
+				}
+			}
+			printf("check %-15s %s: %d/%d rows differ\n", kCoeffNames[c], bgra ? "bgra" : "rgba", rowBad, CHECK_ROUNDS);
+			bad += rowBad;
+		}
+	}
+	free(y);
+	free(u);
+	free(v);
+	free(simd);
+	free(scalar);
+	return bad;
+}
+
+typedef void (*ConvertFun)(AVFrame* src, uint8_t* dst, void* opaque);
+
+static void convertSimd(AVFrame* src, uint8_t* dst, void* opaque) {
+	int y;
+	for (y = 0; y < src->height; y++) {
+		yuv2rgbaRow(src->data[0] + y * src->linesize[0], src->data[1] + (y >> 1) * src->linesize[1],
+			src->data[2] + (y >> 1) * src->linesize[2], dst + y * src->width * 4, src->width, &kYuvBT709Limited, 0);
+	}
+}
+
+static void convertScalar(AVFrame* src, uint8_t* dst, void* opaque) {
+	int y;
+	for (y = 0; y < src->height; y++) {
+		yuv2rgbaRowC(src->data[0] + y * src->linesize[0], src->data[1] + (y >> 1) * src->linesize[1],
+			src->data[2] + (y >> 1) * src->linesize[2], dst + y * src->width * 4, 0, src->width, &kYuvBT709Limited, 0);
+	}
+}
+
+static void convertSws(AVFrame* src, uint8_t* dst, void* opaque) {
+	uint8_t* dstData[4] = { dst, NULL, NULL, NULL };
+	int dstStride[4] = { src->width * 4, 0, 0, 0 };
+	sws_scale((struct SwsContext*)opaque, (const uint8_t* const*)src->data, src->linesize, 0, src->height, dstData, dstStride);
+}
+
+// 每帧的平均时间(ms)
+static double timeFrames(ConvertFun fun, AVFrame* src, uint8_t* dst, void* opaque, int frames) {
+	int i;
+	fun(src, dst, opaque);	// 预热
+	double start = emscripten_get_now();
+	for (i = 0; i < frames; i++) {
+		fun(src, dst, opaque);
+	}
+	return (emscripten_get_now() - start) / frames;
+}
+
+static void benchSize(int width, int height, int frames) {
+	AVFrame* src = av_frame_alloc();
+	if (!src) {
+		printf("av_frame_alloc fail\n");
+		exit(2);
+	}
+	src->width = width;
+	src->height = height;
+	src->format = AV_PIX_FMT_YUV420P;
+	if (av_frame_get_buffer(src, 32) < 0) {
+		printf("av_frame_get_buffer fail\n");
+		exit(2);
+	}
+	int i;
+	for (i = 0; i < 3; i++) {
+		fillRandom(src->data[i], src->linesize[i] * (i == 0 ? height : (height + 1) / 2));
+	}
+	uint8_t* dst = av_malloc(width * height * 4);
+	struct SwsContext* sws = sws_getContext(width, height, AV_PIX_FMT_YUV420P, width, height, AV_PIX_FMT_RGBA,
+		SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	if (!dst || !sws) {
+		printf("alloc fail\n");
+		exit(2);
+	}
+	double simd = timeFrames(convertSimd, src, dst, NULL, frames);
+	double scalar = timeFrames(convertScalar, src, dst, NULL, frames);
+	double swscale = timeFrames(convertSws, src, dst, sws, frames);
+	printf("%dx%d: simd %.3f ms, scalar %.3f ms, swscale %.3f ms, simd vs swscale x%.2f, simd vs scalar x%.2f\n",
+		width, height, simd, scalar, swscale, swscale / simd, scalar / simd);
+	sws_freeContext(sws);
+	av_free(dst);
+	av_frame_free(&src);
+}
+
+int main(int argc, char** argv) {
+#ifndef __wasm_simd128__
+	printf("warning: built without -msimd128, yuv2rgbaRow is the scalar version\n");
+#endif
+	int bad = checkRows();
+	if (bad > 0) {
+		printf("FAIL: %d rows differ\n", bad);
+		return 1;
+	}
+	printf("OK: simd and scalar output are identical\n");
+	benchSize(1280, 720, 100);
+	benchSize(1920, 1080, 50);
+	return 0;
+}
@@ -8,42 +8,69 @@ mkdir -p ${SHELL_FOLDER}/dist
 
 rm -rf dist/libdecoder_264_265.*
 export TOTAL_MEMORY=128MB
+# wasm 线程池大小：所有解码器共用的解码线程(默认 cpu 核数，最多 8 个)
+# + 共用的转格式线程(默认 cpu 核数 - 1，最多 8 个)
+# + 每个解码器 ffmpeg 内部的线程(new Decoder 的 opts.threads，为 1 时不开)
+# 默认按 8 + 8 + 4 路 4 线程解码 = 32，可以通过环境变量覆盖
+export PTHREAD_POOL_SIZE=${PTHREAD_POOL_SIZE:-32}
 export EXPORTED_FUNCTIONS="[ \
+		'_malloc', \
+		'_free', \
 		'_enableLog', \
 		'_disableLog', \
 		'_createH264Decoder', \
 		'_createH265Decoder', \
 		'_releaseDecoder', \
 		'_putBuffer', \
-		'_getFrame' \
+		'_putPacket', \
+		'_enableInputRing', \
+		'_setFrameQueue', \
+		'_setOutputFormat', \
+		'_setOutputSize', \
+		'_setSkipMode', \
+		'_setSchedule', \
+		'_getStats', \
+		'_setConvertThreads', \
+		'_setDecodeThreads', \
+		'_setFrameCallback', \
+		'_getFrame', \
+		'_releaseFrame', \
+		'_getFrames', \
+		'_releaseFrames' \
 ]"
 
 # FLAGS=' -O0 '
 FLAGS=' -Os '
 FLAGS=${FLAGS}' -s ASSERTIONS=1 '
+# yuv 转 rgba 用 wasm simd128，不支持 simd 的环境可以去掉，会用标量版本
+FLAGS=${FLAGS}' -msimd128 '
 
 echo "Running Emscripten..."
 emcc src/decoder3.c ffmpeg/lib/libavformat.a ffmpeg/lib/libavcodec.a ffmpeg/lib/libavutil.a ffmpeg/lib/libswscale.a \
     ${FLAGS} \
     -I "ffmpeg/include" \
     -s WASM=1 \
-    -s TOTAL_MEMORY=${TOTAL_MEMORY} \
-		-s WASM_MEM_MAX=4096MB \
+    -s INITIAL_MEMORY=${TOTAL_MEMORY} \
+    -s MAXIMUM_MEMORY=4096MB \
     -s ALLOW_MEMORY_GROWTH=1 \
    	-s EXPORTED_FUNCTIONS="${EXPORTED_FUNCTIONS}" \
-   	-s EXTRA_EXPORTED_RUNTIME_METHODS="['addFunction']" \
-	-s RESERVED_FUNCTION_POINTERS=14 \
+   	-s EXPORTED_RUNTIME_METHODS="['addFunction', 'wasmMemory']" \
+	-s ALLOW_TABLE_GROWTH=1 \
 	-s FORCE_FILESYSTEM=1 \
 	-s SINGLE_FILE=1 \
 	-s USE_PTHREADS=1 \
-	-s PTHREAD_POOL_SIZE=8 \
+	-s PTHREAD_POOL_SIZE=${PTHREAD_POOL_SIZE} \
+	-s MODULARIZE=1 \
+	-s EXPORT_ES6=1 \
+	-s EXPORT_NAME=createDecoderModule \
+	-s ENVIRONMENT=web,worker,node \
     -o ${SHELL_FOLDER}/dist/libdecoder_264_265.js
 
-# 替换worker文件的路径
-sed -e 's/libdecoder_264_265\.worker\.js/\/wasm_worker\/libdecoder_264_265\.worker\.js/g' -i '' dist/libdecoder_264_265.js
-
-cp ${SHELL_FOLDER}/dist/libdecoder_264_265.js ${SHELL_FOLDER}/dist/libdecoder_264_265.org.js
-
-echo "export default Module" >> ${SHELL_FOLDER}/dist/libdecoder_264_265.js
+# 网页里 worker 文件不和 dist 放在一起时，用 WASM_WORKER_PATH 指定所在的目录，例如 WASM_WORKER_PATH=/wasm_worker/
+# node 里要用默认的路径
+if [ -n "${WASM_WORKER_PATH}" ]; then
+	sed -e "s|libdecoder_264_265\.worker\.js|${WASM_WORKER_PATH}libdecoder_264_265.worker.js|g" dist/libdecoder_264_265.js > dist/libdecoder_264_265.tmp.js
+	mv dist/libdecoder_264_265.tmp.js dist/libdecoder_264_265.js
+fi
 
 echo "Finished Build"
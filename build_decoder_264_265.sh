@@ -10,6 +10,7 @@ cd ${SHELL_FOLDER}/../ffmpeg # ffmpeg 的源码所在的目录
 emconfigure ./configure --cc="emcc" --cxx="em++" --ar="emar" --prefix="${SHELL_FOLDER}/ffmpeg" \
     --enable-cross-compile --target-os=none --arch=x86_32 --cpu=generic \
     --enable-gpl --enable-version3 \
+    --enable-pthreads --extra-cflags="-pthread" --extra-ldflags="-pthread" \
     --disable-debug --disable-asm --disable-doc \
     --disable-avdevice --disable-swresample --disable-postproc --disable-avfilter \
     --disable-programs --disable-protocols --disable-network \
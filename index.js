@@ -1,6 +1,20 @@
-import libDe from './dist/libdecoder_264_265'
+// dist 由 build.sh 用 MODULARIZE/EXPORT_ES6 编译，默认导出的是创建 wasm 模块的函数，模块初始化完才 resolve
+// dist 不在仓库里，要先用 build.sh 构建。用动态 import，dist 没构建、过期或者在当前环境里加载失败时也能走到 setReadyCb，创建解码器时抛出错误
+let libDe = null
 
-libDe.postRun = readyCb
+import('./dist/libdecoder_264_265.js')
+  .then((mod) => {
+    if (typeof mod.default !== 'function') {
+      throw new Error('not built with MODULARIZE/EXPORT_ES6')
+    }
+    return mod.default()
+  })
+  .then((m) => {
+    libDe = m
+    readyCb()
+  }, (e) => {
+    finishInit(new Error('dist/libdecoder_264_265.js is missing or stale (' + (e && e.message || e) + '), run build.sh to build it'))
+  })
 
 const LOG_LEVEL_PANIC = 0
 const LOG_LEVEL_FATAL = 8
@@ -13,6 +27,42 @@ const LOG_LEVEL_TRACE = 56
 
 let gLogLevel = -1
 
+// 解码器内部多线程方式，和 decoder3.c 里的 DECODER_THREAD_* 对应
+const THREAD_TYPE_FRAME = 1
+const THREAD_TYPE_SLICE = 2
+
+function threadTypeToInt(typ) {
+  switch (typ) {
+    case 'frame':
+      return THREAD_TYPE_FRAME
+    case 'slice':
+      return THREAD_TYPE_SLICE
+    case 'auto':
+      return THREAD_TYPE_FRAME | THREAD_TYPE_SLICE
+    default:
+      break
+  }
+  return 0
+}
+
+// 创建解码器时的选项，和 decoder3.c 里的 DECODER_FLAG_* 对应
+const DECODER_FLAG_LIVE = 1
+
+// 解码线程数，'auto' 时按 cpu 核数来，但不超过 wasm 线程池的大小
+const MAX_THREAD_COUNT = 8
+
+function threadCountToInt(count) {
+  if (count === 'auto') {
+    const cores = (typeof navigator !== 'undefined' && navigator.hardwareConcurrency) || 1
+    return Math.min(cores, MAX_THREAD_COUNT)
+  }
+  const n = parseInt(count, 10)
+  if (!(n > 0)) {
+    return 1
+  }
+  return Math.min(n, MAX_THREAD_COUNT)
+}
+
 function logLevelToInt(level) {
   let l = -1
   switch (level) {
@@ -95,10 +145,368 @@ function log(level, _) {
   }
 }
 
+// 输出队列满了之后的处理方式，和 decoder3.c 里的 FRAME_POLICY_* 对应
+const FRAME_POLICY_BLOCK = 0
+const FRAME_POLICY_DROP_OLDEST = 1
+const FRAME_POLICY_LATEST = 2
+
+function framePolicyToInt(policy) {
+  switch (policy) {
+    case 'drop-oldest':
+      return FRAME_POLICY_DROP_OLDEST
+    case 'latest':
+      return FRAME_POLICY_LATEST
+    default:
+      break
+  }
+  return FRAME_POLICY_BLOCK
+}
+
+// 输出格式，和 decoder3.c 里的 OUTPUT_FORMAT_* 对应
+const OUTPUT_FORMAT_RGBA = 0
+const OUTPUT_FORMAT_I420 = 1
+const OUTPUT_FORMAT_BGRA = 2
+
+function outputFormatToInt(format) {
+  if (format === 'i420' || format === 'yuv') {
+    return OUTPUT_FORMAT_I420
+  }
+  if (format === 'bgra') {
+    return OUTPUT_FORMAT_BGRA
+  }
+  return OUTPUT_FORMAT_RGBA
+}
+
+// 缩放算法，和 decoder3.c 里的 SCALE_FILTER_* 对应
+const SCALE_FILTER_FAST_BILINEAR = 0
+const SCALE_FILTER_BILINEAR = 1
+const SCALE_FILTER_AREA = 2
+
+function scaleFilterToInt(filter) {
+  switch (filter) {
+    case 'bilinear':
+      return SCALE_FILTER_BILINEAR
+    case 'area':
+      return SCALE_FILTER_AREA
+    default:
+      break
+  }
+  return SCALE_FILTER_FAST_BILINEAR
+}
+
+// 丢帧级别，和 ffmpeg 的 AVDISCARD_* 对应
+const DISCARD_LEVELS = {
+  none: -16,    // 什么都不丢
+  default: 0,   // ffmpeg 默认
+  nonref: 8,    // 丢非参考帧
+  bidir: 16,    // 丢双向预测帧
+  nonintra: 24, // 丢非帧内编码的帧
+  nonkey: 32,   // 只留关键帧
+  all: 48       // 全丢
+}
+
+// 预置的丢帧模式：预览小窗用 'nonref'，快进/缩略图用 'keyframe'
+const SKIP_MODES = {
+  none: { frame: 'default', loopFilter: 'default', idct: 'default' },
+  nonref: { frame: 'nonref', loopFilter: 'nonref', idct: 'default' },
+  keyframe: { frame: 'nonkey', loopFilter: 'nonref', idct: 'default' }
+}
+
+function discardToInt(level) {
+  const v = DISCARD_LEVELS[level]
+  return v === undefined ? DISCARD_LEVELS.default : v
+}
+
+// decoder3.c 里 Frame 结构各字段的下标(按 int32 算)
+const FRAME_WIDTH = 0
+const FRAME_HEIGHT = 1
+const FRAME_DATA = 2
+const FRAME_FORMAT = 3
+const FRAME_PLANES = 4
+const FRAME_STRIDES = 7
+const FRAME_PTS = 5 // 按 float64 算
+const FRAME_DURATION = 6
+
+// decoder3.c 里 DecoderStats 结构各字段的下标，前四个是 double(按 float64 算)，后面的按 int32 算
+const STATS_DECODE_LATENCY = 0
+const STATS_AVG_DECODE_LATENCY = 1
+const STATS_TIME_TO_FIRST_FRAME = 3
+const STATS_REORDER_DELAY = 8
+const STATS_THREAD_DELAY = 9
+const STATS_LOW_DELAY = 10
+const STATS_FLUSH_COUNT = 11
+const STATS_AUTO_SKIP = 12
+const STATS_CPU_LOAD = 13
+const STATS_BYTES_IN = 14 // uint64，低 32 位在前
+const STATS_PACKETS = 16
+const STATS_FRAMES_DECODED = 17
+const STATS_FRAMES_CONVERTED = 18
+const STATS_FRAMES_DELIVERED = 19
+const STATS_FRAMES_DROPPED = 20
+const STATS_INPUT_QUEUE = 21
+const STATS_FRAME_QUEUE = 22
+const STATS_HIST = 23
+
+// 各阶段耗时的直方图，顺序和 decoder3.c 里的 STATS_HIST_* 一样
+// 第 i 格是 [2^i, 2^(i+1)) us，第 0 格是 2us 以下，最后一格是更长的
+const STATS_HIST_NAMES = ['parse', 'decode', 'convert', 'queueWait', 'putToGet']
+const STATS_HIST_BUCKETS = 20
+
+// 读一个直方图，p50/p90/p99 是所在格的上限(ms)，只能看个大概
+function readHistogram(heapU32, idx) {
+  const buckets = Array.from(heapU32.subarray(idx, idx + STATS_HIST_BUCKETS))
+  const count = buckets.reduce((a, b) => a + b, 0)
+  const percentile = (p) => {
+    if (count === 0) {
+      return 0
+    }
+    let sum = 0
+    for (let i = 0; i < STATS_HIST_BUCKETS - 1; i++) {
+      sum += buckets[i]
+      if (sum >= count * p) {
+        return Math.pow(2, i + 1) / 1000
+      }
+    }
+    return Infinity
+  }
+  return { count, p50: percentile(0.5), p90: percentile(0.9), p99: percentile(0.99), buckets }
+}
+
+// 调度器自动降级的丢帧等级，和 decoder3.c 里的 AUTO_SKIP_* 对应
+const AUTO_SKIP_NAMES = ['none', 'nonref', 'keyframe']
+
+// wasm 内存的视图。内存在解码线程里扩容时主线程的 libDe.HEAP* 不会马上更新，还是旧的 ArrayBuffer 上的，
+// 所以每次用之前按 wasmMemory.buffer 检查一下，变了就重建
+const gHeap = { buffer: null, u8: null, i32: null, u32: null, f64: null }
+
+function heap() {
+  const buffer = libDe.wasmMemory.buffer
+  if (gHeap.buffer !== buffer) {
+    gHeap.buffer = buffer
+    gHeap.u8 = new Uint8Array(buffer)
+    gHeap.i32 = new Int32Array(buffer)
+    gHeap.u32 = new Uint32Array(buffer)
+    gHeap.f64 = new Float64Array(buffer)
+  }
+  return gHeap
+}
+
+// 从 wasm 内存里读出一帧，数据拷贝出来
+function readFrame(frame) {
+  const h = heap()
+  const heap32 = h.i32
+  const heapU8 = h.u8
+  const idx = frame >> 2
+  const width = heap32[idx + FRAME_WIDTH]
+  const height = heap32[idx + FRAME_HEIGHT]
+  const format = heap32[idx + FRAME_FORMAT]
+  const pts = h.f64[(frame >> 3) + FRAME_PTS]
+  const duration = h.f64[(frame >> 3) + FRAME_DURATION]
+  if (format === OUTPUT_FORMAT_I420) {
+    const strides = []
+    const planes = []
+    for (let i = 0; i < 3; i++) {
+      const ptr = heap32[idx + FRAME_PLANES + i]
+      const stride = heap32[idx + FRAME_STRIDES + i]
+      const rows = i === 0 ? height : (height + 1) >> 1
+      strides.push(stride)
+      planes.push(new Uint8Array(heapU8.subarray(ptr, ptr + stride * rows)))
+    }
+    return {
+      width,
+      height,
+      format: 'i420',
+      pts,
+      duration,
+      y: planes[0],
+      u: planes[1],
+      v: planes[2],
+      strides
+    }
+  }
+  const dataPtr = heap32[idx + FRAME_DATA]
+  const dataSize = (width * height) << 2
+  const data = new Uint8Array(heapU8.subarray(dataPtr, dataPtr + dataSize))
+  if (format === OUTPUT_FORMAT_BGRA) {
+    return {
+      width,
+      height,
+      format: 'bgra',
+      pts,
+      duration,
+      data
+    }
+  }
+  return {
+    width,
+    height,
+    pts,
+    duration,
+    data
+  }
+}
+
+// 不拷贝的帧，直接是 wasm 内存上的视图，用完要 release 还给解码器
+// 视图每次访问时检查 wasm 内存有没有扩容(wasmMemory.buffer 变了)，变了就重建；release 之后访问得到 null
+class FrameView {
+  constructor(decoder, frame) {
+    const h = heap()
+    const heap32 = h.i32
+    const idx = frame >> 2
+    this._decoder = decoder
+    this._frame = frame
+    this._buffer = null
+    this._views = null
+    this.width = heap32[idx + FRAME_WIDTH]
+    this.height = heap32[idx + FRAME_HEIGHT]
+    const format = heap32[idx + FRAME_FORMAT]
+    this.format = format === OUTPUT_FORMAT_I420 ? 'i420' : (format === OUTPUT_FORMAT_BGRA ? 'bgra' : 'rgba')
+    this.pts = h.f64[(frame >> 3) + FRAME_PTS]
+    this.duration = h.f64[(frame >> 3) + FRAME_DURATION]
+    this.strides = [heap32[idx + FRAME_STRIDES], heap32[idx + FRAME_STRIDES + 1], heap32[idx + FRAME_STRIDES + 2]]
+  }
+
+  _getViews() {
+    if (!this._frame) {
+      return null
+    }
+    const h = heap()
+    const buffer = h.buffer
+    if (this._buffer === buffer) {
+      return this._views
+    }
+    const heap32 = h.i32
+    const idx = this._frame >> 2
+    if (this.format === 'i420') {
+      const planes = []
+      for (let i = 0; i < 3; i++) {
+        const ptr = heap32[idx + FRAME_PLANES + i]
+        const rows = i === 0 ? this.height : (this.height + 1) >> 1
+        planes.push(new Uint8Array(buffer, ptr, this.strides[i] * rows))
+      }
+      this._views = { y: planes[0], u: planes[1], v: planes[2] }
+    } else {
+      const ptr = heap32[idx + FRAME_DATA]
+      this._views = { data: new Uint8ClampedArray(buffer, ptr, (this.width * this.height) << 2) }
+    }
+    this._buffer = buffer
+    return this._views
+  }
+
+  // rgba/bgra 的像素，Uint8ClampedArray
+  get data() {
+    const v = this._getViews()
+    return v ? v.data : null
+  }
+
+  // i420 的三个平面
+  get y() {
+    const v = this._getViews()
+    return v ? v.y : null
+  }
+
+  get u() {
+    const v = this._getViews()
+    return v ? v.u : null
+  }
+
+  get v() {
+    const v = this._getViews()
+    return v ? v.v : null
+  }
+
+  // 还给解码器，之后不能再用这一帧的数据，重复调用没关系
+  release() {
+    if (!this._frame) {
+      return
+    }
+    this._decoder._releaseView(this)
+    this._frame = 0
+    this._buffer = null
+    this._views = null
+  }
+}
+
+// put 的选项，和 decoder3.c 里的 BUFFER_FLAG_* 对应
+const BUFFER_FLAG_END_OF_AU = 1
+const BUFFER_FLAG_FLUSH = 2
+const BUFFER_FLAG_KEY_FRAME = 4
+const BUFFER_FLAG_PACKET = 8
+
+function putFlagsToInt(opts) {
+  return opts && opts.endOfAU ? BUFFER_FLAG_END_OF_AU : 0
+}
+
+// 时间戳转成传给 decoder3.c 的 double(ms)，没有时是 NaN
+function tsToDouble(ts) {
+  return typeof ts === 'number' ? ts : NaN
+}
+
+// decoder3.c 里 RingMark 结构的大小(按 int32 算)
+const RING_MARK_INTS = 8
+
+// 环满了写不下时，隔多久(ms)再试一次
+const RING_RETRY_INTERVAL = 2
+
+// getFrames 一次最多取的帧数
+const MAX_BATCH_FRAMES = 64
+
+// 和 ffmpeg 的 AV_INPUT_BUFFER_PADDING_SIZE 一致，put 的数据后面要补这么多 0 给 parser
+const INPUT_PADDING_SIZE = 64
+
 const gReadyCbs = []
 let gReady = false
+let gInitError = null // dist 和 index.js 对不上时的错误，创建解码器时抛出
+
+// index.js 用到的 wasm 导出，和 build.sh 的 EXPORTED_FUNCTIONS 一致，dist 没有重新编译时会缺
+const REQUIRED_EXPORTS = [
+  '_malloc', '_free', 'addFunction', '_enableLog', '_disableLog', '_createH264Decoder', '_createH265Decoder', '_releaseDecoder',
+  '_putBuffer', '_putPacket', '_enableInputRing', '_setFrameQueue', '_setOutputFormat', '_setOutputSize',
+  '_setSkipMode', '_setSchedule', '_getStats', '_setConvertThreads', '_setDecodeThreads',
+  '_setFrameCallback', '_getFrame', '_releaseFrame', '_getFrames', '_releaseFrames'
+]
+
+// 回调方式，和 decoder3.c 里的 FRAME_CB_* 对应
+const FRAME_CB_DELIVER = 0
+const FRAME_CB_NOTIFY = 1
+
+// 所有设置了 onFrame/onFrameReady 的解码器共用一个 wasm 回调，opaque 是解码器的 id
+let gFrameCbPtr = 0
+let gNextDecoderId = 1
+const gFrameDecoders = new Map()
+
+function frameCb(opaque, frame) {
+  const de = gFrameDecoders.get(opaque)
+  if (!de || !de._onFrame) {
+    return
+  }
+  if (!frame) {
+    // onFrameReady，帧还在队列里
+    de._onFrame()
+    return
+  }
+  // 帧在回调返回后就还回帧池了，这里拷贝出来
+  de._onFrame(readFrame(frame))
+}
 
 function readyCb() {
+  const missing = REQUIRED_EXPORTS.filter((name) => typeof libDe[name] !== 'function')
+  if (!(libDe.wasmMemory instanceof WebAssembly.Memory)) {
+    missing.push('wasmMemory')
+  }
+  if (missing.length > 0) {
+    finishInit(new Error('dist/libdecoder_264_265.js is stale (missing ' + missing.join(', ') + '), run build.sh to rebuild it'))
+    return
+  }
+  finishInit(null)
+}
+
+// 初始化结束，err 不为空时是失败的原因，之后创建解码器时抛出
+function finishInit(err) {
+  if (err) {
+    gInitError = err
+    console.error(err.message)
+  }
   gReady = true
   for (const cb of gReadyCbs) {
     setTimeout(cb, 0)
@@ -111,6 +519,9 @@ class Decoder {
     const l = logLevelToInt(level)
     gLogLevel = l
     log('debug', 'libDe:', libDe)
+    if (gInitError) {
+      return
+    }
     if (l < 0) {
       libDe._disableLog()
     } else {
@@ -118,6 +529,20 @@ class Decoder {
     }
   }
 
+  // 设置解码线程数，所有解码器共用，只能增加，要在创建解码器之前调用
+  // n 是数字或 'auto'(cpu 核数)，返回实际的线程数
+  static setDecodeThreads(n) {
+    const count = n === 'auto' ? 0 : threadCountToInt(n)
+    return gInitError ? 0 : libDe._setDecodeThreads(count)
+  }
+
+  // 设置转格式(yuv 转 rgba)用的线程数，所有解码器共用。不调用时第一次有大帧要转时按 cpu 核数 - 1 启动
+  // n 是数字或 'auto'(cpu 核数 - 1)，可以改小，返回分段时会用的线程数
+  static setConvertThreads(n) {
+    const count = n === 'auto' ? 0 : threadCountToInt(n)
+    return gInitError ? 0 : libDe._setConvertThreads(count)
+  }
+
   // 设置编码器初始化的回调，初始化完毕后才能进行后续操作，包括创建对象
   static setReadyCb(cb) {
     if (gReady) {
@@ -132,12 +557,48 @@ class Decoder {
     return gReady
   }
 
-  // 构造函数，参数是编码类型
-  constructor(typ, frameCB) {
+  // 构造函数，参数是编码类型和选项
+  // opts.threads: 解码线程数，数字或 'auto'，默认 1
+  // opts.threadType: 'frame' | 'slice' | 'auto'，默认由 ffmpeg 决定
+  // opts.profile: 'live' 实时模式，低延迟，只用 slice 多线程，解出来立刻输出
+  // opts.queueDepth: 输出队列长度，默认 8
+  // opts.overflow: 输出队列满了之后 'block' 阻塞解码(默认) | 'drop-oldest' 丢最老的 | 'latest' 只留最新一帧
+  // opts.outputFormat: 输出格式 'rgba'(默认) | 'bgra' | 'i420'，i420 时不转格式，直接给出 y/u/v 三个平面
+  // opts.outputWidth/opts.outputHeight: 输出尺寸，转格式时直接缩放，只给一边时按比例，默认原尺寸
+  // opts.scaleFilter: 缩放算法 'fast-bilinear'(默认) | 'bilinear' | 'area'
+  // opts.skipMode: 丢帧模式，见 setSkipMode
+  // opts.ringSize: 输入环形缓冲的字节数，>0 时 put 直接写进 wasm 内存里的环，不再每次 malloc
+  // opts.priority/opts.deadline/opts.budget: 调度参数，见 setSchedule
+  // opts.zeroCopy: get/getFrames 返回不拷贝的帧(FrameView)，data 或 y/u/v 直接是 wasm 内存上的视图，用完要调用 frame.release()
+  // opts.onFrame: 有新帧时调用 onFrame(frame)，帧的格式和 get 返回的一样，解码线程出帧后立刻在主线程通知，不用轮询 get
+  // opts.onFrameReady: 有新帧进了输出队列时调用 onFrameReady()，帧留在队列里，按自己的节奏用 get/getFrames 取，
+  //   'block' 时没取走的帧会让解码暂停。和 onFrame 只能用一个
+  // opts.extradata: mp4/flv 里的 avcC/hvcC(Uint8Array)，给了之后 put/putPacket 直接输入长度前缀格式的 sample，
+  //   每次一个完整的 sample，不用转成 Annex B
+  constructor(typ, opts) {
     const self = this
+    if (gInitError) {
+      throw gInitError
+    }
+    opts = opts || {}
+    const threadCount = threadCountToInt(opts.threads)
+    const threadType = threadTypeToInt(opts.threadType)
+    const flags = opts.profile === 'live' ? DECODER_FLAG_LIVE : 0
     this._buf = []
     this._initBuf = []
     this._infoReady = false
+    // avcC/hvcC 的第一个字节是 configurationVersion(1)，Annex B 是起始码
+    this._lengthPrefixed = !!(opts.extradata && opts.extradata[0] === 1)
+    let extradata = 0
+    let extradataSize = 0
+    if (opts.extradata && opts.extradata.length > 0) {
+      extradataSize = opts.extradata.length
+      extradata = libDe._malloc(extradataSize)
+      if (!extradata) {
+        throw new Error('malloc extradata fail')
+      }
+      heap().u8.set(opts.extradata, extradata)
+    }
 
     // const cb = libDe.addFunction((opaque, frame) => {
     //   const widthBuf = libDe.HEAPU8.subarray(frame, frame + 4)
@@ -158,23 +619,54 @@ class Decoder {
     switch (typ) {
       case 'h264':
         {
-          this._ctx = libDe._createH264Decoder()
+          this._ctx = libDe._createH264Decoder(threadCount, threadType, flags, extradata, extradataSize)
           this._typ = 'h264'
         }
         break
       case 'h265':
         {
-          this._ctx = libDe._createH265Decoder()
+          this._ctx = libDe._createH265Decoder(threadCount, threadType, flags, extradata, extradataSize)
           this._typ = 'h265'
         }
         break
       default:
+        libDe._free(extradata)
         throw new Error('not support type:', typ)
     }
+    // 解码器里拷贝了一份
+    libDe._free(extradata)
     if (!this._ctx) {
       throw new Error('createDecoder fail:', typ)
     }
-    log('debug', 'Decoder constructored', typ)
+    if (opts.queueDepth !== undefined || opts.overflow !== undefined) {
+      this.setFrameQueue(opts.queueDepth, opts.overflow)
+    }
+    if (opts.outputFormat) {
+      this.setOutputFormat(opts.outputFormat)
+    }
+    if (opts.outputWidth || opts.outputHeight) {
+      this.setOutputSize(opts.outputWidth, opts.outputHeight, opts.scaleFilter)
+    }
+    if (opts.skipMode) {
+      this.setSkipMode(opts.skipMode)
+    }
+    if (opts.priority !== undefined || opts.deadline !== undefined || opts.budget !== undefined) {
+      this.setSchedule(opts)
+    }
+    if (opts.onFrame) {
+      this._setOnFrame(opts.onFrame, FRAME_CB_DELIVER)
+    } else if (opts.onFrameReady) {
+      this._setOnFrame(opts.onFrameReady, FRAME_CB_NOTIFY)
+    }
+    this._batchBuf = 0 // getFrames 用的帧指针数组，第一次用时分配
+    this._zeroCopy = !!opts.zeroCopy
+    this._views = new Set() // 还没 release 的 FrameView
+    this._flushReq = 0 // 调用 flush 的次数，和 DecoderStats.flushCount 比较
+    this._ring = null
+    if (opts.ringSize > 0) {
+      this._ring = this._initRing(opts.ringSize)
+    }
+    log('debug', 'Decoder constructored', typ, 'threads:', threadCount, 'threadType:', threadType)
   }
 
   // _cb(opaque, buf, bufSize) {
@@ -208,13 +700,52 @@ class Decoder {
     return this._typ
   }
 
+  _setOnFrame(cb, mode) {
+    if (!gFrameCbPtr) {
+      gFrameCbPtr = libDe.addFunction(frameCb, 'vii')
+    }
+    this._id = gNextDecoderId++
+    this._onFrame = cb
+    gFrameDecoders.set(this._id, this)
+    libDe._setFrameCallback(this._ctx, gFrameCbPtr, this._id, mode)
+  }
+
+  // 设置输出队列长度和满了之后的处理方式，可以随时调用
+  setFrameQueue(depth, overflow) {
+    if (!this._ctx) {
+      log('error', 'no _ctx when setFrameQueue')
+      return
+    }
+    const r = libDe._setFrameQueue(this._ctx, depth | 0, framePolicyToInt(overflow))
+    if (r < 0) {
+      log('error', 'setFrameQueue fail', depth, overflow)
+    }
+  }
+
   // 析构函数，是否资源
   async dispose() {
     if (!this._ctx) {
       return
     }
+    if (this._id) {
+      gFrameDecoders.delete(this._id)
+      this._onFrame = null
+    }
+    // 没 release 的帧先还回去，视图都失效
+    for (const view of Array.from(this._views)) {
+      view.release()
+    }
+    if (this._ring && this._ring.retryTimer) {
+      clearTimeout(this._ring.retryTimer)
+      this._ring.retryTimer = null
+    }
     libDe._releaseDecoder(this._ctx)
+    if (this._batchBuf) {
+      libDe._free(this._batchBuf)
+      this._batchBuf = 0
+    }
     this._ctx = null
+    this._ring = null
     this._typ = ''
   }
 
@@ -236,9 +767,164 @@ class Decoder {
   //   this._buf.push(buf)
   //   return
   // }
-  put(buf) {
+  // 启用输入环形缓冲，结构见 decoder3.c 里的 InputRing
+  _initRing(size) {
+    const r = libDe._enableInputRing(this._ctx, size)
+    if (!r) {
+      throw new Error('enableInputRing fail:', size)
+    }
+    const idx = r >> 2
+    const heapU32 = heap().u32
+    return {
+      headIdx: idx,
+      tailIdx: idx + 1,
+      size: heapU32[idx + 2],
+      data: heapU32[idx + 3],
+      wakeIdx: heapU32[idx + 4] >> 2,
+      markHeadIdx: idx + 5,
+      markTailIdx: idx + 6,
+      markCount: heapU32[idx + 7],
+      marksIdx: idx + 8, // 每个标记 RING_MARK_INTS 个 int32
+      pending: [], // 环满了写不下的数据 { data, flags }，等解码线程腾出空间再写
+      retryTimer: null // pending 不为空时定时重试，不依赖调用方再 put/get
+    }
+  }
+
+  // 环满了还没写进去的字节数
+  _pendingBytes() {
+    if (!this._ring) {
+      return 0
+    }
+    return this._ring.pending.reduce((sum, item) => sum + item.data.length, 0)
+  }
+
+  // 尽量把 pending 里的数据写进环
+  _flushRing() {
+    const ring = this._ring
+    const h = heap()
+    const heap32 = h.i32
+    const heapU8 = h.u8
+    let wake = false
+    while (ring.pending.length > 0) {
+      const head = Atomics.load(heap32, ring.headIdx) >>> 0
+      const tail = Atomics.load(heap32, ring.tailIdx) >>> 0
+      const free = ring.size - ((head - tail) >>> 0)
+      const item = ring.pending[0]
+      const data = item.data
+      if (free <= 0 && data.length > 0) {
+        break
+      }
+      if (item.mark) {
+        // 带时间戳或 flags 的数据开始写之前先写标记，标记满了就等解码线程处理
+        if (!this._writeMark(head, item)) {
+          break
+        }
+        item.mark = false
+      }
+      const n = Math.min(free, data.length)
+      const pos = head & (ring.size - 1)
+      const first = Math.min(n, ring.size - pos)
+      heapU8.set(data.subarray(0, first), ring.data + pos)
+      if (n > first) {
+        heapU8.set(data.subarray(first, n), ring.data)
+      }
+      Atomics.store(heap32, ring.headIdx, (head + n) | 0)
+      if (n === data.length) {
+        ring.pending.shift()
+      } else {
+        item.data = data.subarray(n)
+      }
+      wake = true
+    }
+    if (wake) {
+      Atomics.add(heap32, ring.wakeIdx, 1)
+      Atomics.notify(heap32, ring.wakeIdx, 1)
+    }
+    if (ring.pending.length > 0 && !ring.retryTimer) {
+      // 解码线程读走数据不会通知 js，定时看 tail 有没有动
+      ring.retryTimer = setTimeout(() => {
+        ring.retryTimer = null
+        if (this._ring === ring) {
+          this._flushRing()
+        }
+      }, RING_RETRY_INTERVAL)
+    }
+  }
+
+  // 写一个标记，结构见 decoder3.c 里的 RingMark，标记满了返回 false
+  _writeMark(head, item) {
+    const ring = this._ring
+    const h = heap()
+    const heap32 = h.i32
+    const markHead = Atomics.load(heap32, ring.markHeadIdx) >>> 0
+    const markTail = Atomics.load(heap32, ring.markTailIdx) >>> 0
+    if (((markHead - markTail) >>> 0) >= ring.markCount) {
+      return false
+    }
+    const m = ring.marksIdx + (markHead % ring.markCount) * RING_MARK_INTS
+    h.f64[m >> 1] = item.pts
+    h.f64[(m >> 1) + 1] = item.dts
+    heap32[m + 4] = head | 0
+    heap32[m + 5] = (head + item.data.length) | 0
+    heap32[m + 6] = item.flags
+    Atomics.store(heap32, ring.markHeadIdx, (markHead + 1) | 0)
+    return true
+  }
+
+  _putRing(buf, flags, pts, dts) {
+    const ring = this._ring
+    const mark = flags !== 0 || !isNaN(pts) || !isNaN(dts)
+    ring.pending.push({ data: buf, flags, pts, dts, mark })
+    this._flushRing()
+    // 写不下的部分只能是这次的 buf，拷贝一份留着，调用方可能会复用 buf
+    const last = ring.pending.length - 1
+    if (last >= 0 && ring.pending[last].data.buffer === buf.buffer) {
+      ring.pending[last].data = ring.pending[last].data.slice()
+    }
+  }
+
+  // 输入编码数据，buf 是 Uint8Array
+  // pts/dts: buf 里开始的那一帧的时间戳(ms)，可以不给，会经过解码器重排序后带到 get 出来的帧上
+  // opts.endOfAU: buf 正好是一个完整的 AU(一帧)，整段作为一个包立刻送去解码，不用等下一帧的起始码，
+  // 按帧输入的实时流建议每帧都带上，能少一帧的延迟
+  // 也可以写成 put(buf, { pts, dts, endOfAU })
+  put(buf, pts, dts, opts) {
+    if (pts !== null && typeof pts === 'object') {
+      opts = pts
+      pts = opts.pts
+      dts = opts.dts
+    }
+    if (this._lengthPrefixed) {
+      // 长度前缀格式 parser 处理不了，每次 put 的都当作一个完整的 sample
+      this.putPacket(buf, pts, dts, opts)
+      return
+    }
+    this._put('put', buf, putFlagsToInt(opts), pts, dts)
+  }
+
+  // 输入一个完整的包(一个 AU，例如 RTP 组好的帧或者 mp4 里的一个 sample，Annex B 格式)，不经过 parser 直接解码
+  // pts/dts 同 put，opts.key: 是否是关键帧，也可以写成 putPacket(buf, { pts, dts, key })
+  // 不要和 put 混用
+  putPacket(buf, pts, dts, opts) {
+    if (pts !== null && typeof pts === 'object') {
+      opts = pts
+      pts = opts.pts
+      dts = opts.dts
+    }
+    let flags = BUFFER_FLAG_PACKET
+    if (opts && opts.key) {
+      flags |= BUFFER_FLAG_KEY_FRAME
+    }
+    if (this._ring && buf && buf.length > this._ring.size) {
+      log('error', 'packet larger than ring:', buf.length)
+      return
+    }
+    this._put('putPacket', buf, flags, pts, dts)
+  }
+
+  _put(name, buf, flags, pts, dts) {
     if (!this._ctx) {
-      log('error', 'no _ctx when put')
+      log('error', 'no _ctx when', name)
       return
     }
     if (!buf) {
@@ -249,37 +935,217 @@ class Decoder {
       log('error', 'param buf must be Uint8Array')
       return
     }
-    const b = libDe._malloc(buf.length);
+    pts = tsToDouble(pts)
+    dts = tsToDouble(dts)
+    if (this._ring) {
+      this._putRing(buf, flags, pts, dts)
+      return
+    }
+    const b = libDe._malloc(buf.length + INPUT_PADDING_SIZE);
     if (!b) {
-      log('error', 'malloc err in put')
+      log('error', 'malloc err in', name)
       return
     }
-    libDe.HEAPU8.set(buf, b)
-    const r = libDe._putBuffer(this._ctx, b, buf.length)
+    const heapU8 = heap().u8
+    heapU8.set(buf, b)
+    heapU8.fill(0, b + buf.length, b + buf.length + INPUT_PADDING_SIZE)
+    const fn = (flags & BUFFER_FLAG_PACKET) ? libDe._putPacket : libDe._putBuffer
+    const r = fn(this._ctx, b, buf.length, flags, pts, dts)
     if (r < 0) {
       libDe._free(b)
     }
-    return
+  }
+
+  // 流结束，把解码器里因为重排序和多线程攒着的帧都输出，然后重置解码器，之后可以接着 put 下一段流
+  // flush 之后一直 get，直到 flushing() 返回 false 并且 get 返回 null，这段流的帧就取完了
+  flush() {
+    if (!this._ctx) {
+      log('error', 'no _ctx when flush')
+      return
+    }
+    this._flushReq = (this._flushReq + 1) | 0
+    if (this._ring) {
+      this._putRing(new Uint8Array(0), BUFFER_FLAG_FLUSH, NaN, NaN)
+      return
+    }
+    const r = libDe._putBuffer(this._ctx, 0, 0, BUFFER_FLAG_FLUSH, NaN, NaN)
+    if (r < 0) {
+      this._flushReq = (this._flushReq - 1) | 0
+      log('error', 'flush fail')
+    }
+  }
+
+  // 是否还有没完成的 flush
+  flushing() {
+    if (!this._ctx) {
+      return false
+    }
+    const i32 = libDe._getStats(this._ctx) >> 2
+    return Atomics.load(heap().i32, i32 + STATS_FLUSH_COUNT) !== this._flushReq
   }
 
   get() {
+    if (this._ring && this._ring.pending.length > 0) {
+      this._flushRing()
+    }
     const frame = libDe._getFrame(this._ctx)
     if (!frame) {
       return null
     }
-    const widthBuf = libDe.HEAPU8.subarray(frame, frame + 4)
-    const heightBuf = libDe.HEAPU8.subarray(frame + 4, frame + 8)
-    const width = buf2int(widthBuf)
-    const height = buf2int(heightBuf)
-    // log('info', 'width:', width, ', height:', height)
-    const dataSize = (width * height) << 2
-    // log('error', 'dataSize:', dataSize)
-    const data = new Uint8Array(libDe.HEAPU8.subarray(frame + 8, frame + 8 + dataSize))
-    libDe._free(frame)
+    if (this._zeroCopy) {
+      return this._newView(frame)
+    }
+    const ret = readFrame(frame)
+    // 帧的内存还回解码器的帧池复用
+    libDe._releaseFrame(this._ctx, frame)
+    return ret
+  }
+
+  _newView(frame) {
+    const view = new FrameView(this, frame)
+    this._views.add(view)
+    return view
+  }
+
+  _releaseView(view) {
+    this._views.delete(view)
+    if (this._ctx) {
+      libDe._releaseFrame(this._ctx, view._frame)
+    }
+  }
+
+  // 一次取出所有解好的帧(最多 max 帧，默认 64)，返回数组，每一帧和 get 返回的一样
+  // 积压了很多帧时比循环调用 get 少很多次 js 和 wasm 之间的调用和加锁
+  getFrames(max) {
+    if (!this._ctx) {
+      return []
+    }
+    if (this._ring && this._ring.pending.length > 0) {
+      this._flushRing()
+    }
+    if (!this._batchBuf) {
+      this._batchBuf = libDe._malloc(MAX_BATCH_FRAMES * 4)
+      if (!this._batchBuf) {
+        log('error', 'malloc err in getFrames')
+        return []
+      }
+    }
+    max = max > 0 ? Math.min(max, MAX_BATCH_FRAMES) : MAX_BATCH_FRAMES
+    const n = libDe._getFrames(this._ctx, this._batchBuf, max)
+    const frames = []
+    const idx = this._batchBuf >> 2
+    const heapU32 = heap().u32
+    if (this._zeroCopy) {
+      for (let i = 0; i < n; i++) {
+        frames.push(this._newView(heapU32[idx + i]))
+      }
+      return frames
+    }
+    for (let i = 0; i < n; i++) {
+      frames.push(readFrame(heapU32[idx + i]))
+    }
+    if (n > 0) {
+      libDe._releaseFrames(this._ctx, this._batchBuf, n)
+    }
+    return frames
+  }
+
+  // 取统计信息
+  // decodeLatency/avgDecodeLatency: 从送进解码器到解出来的时间(ms)，最近一帧/平均
+  // timeToFirstFrame: 从解码线程第一次读到数据到第一帧解出来的时间(ms)，还没出帧时是 0
+  // reorderDelay: 帧重排序带来的延迟帧数，threadDelay: 帧级多线程带来的延迟帧数
+  // autoSkip: 调度器自动降级的丢帧模式，cpuLoad: 最近一秒解码占一个线程时间的百分比
+  // bytesIn/packets/framesDecoded/framesConverted/framesDelivered/framesDropped: 各阶段的累计计数
+  // inputQueue: 还没处理的输入字节数，frameQueue: 输出队列里的帧数
+  // timings: parse/decode/convert/queueWait/putToGet 各阶段耗时的直方图 { count, p50, p90, p99, buckets }
+  getStats() {
+    if (!this._ctx) {
+      return null
+    }
+    const p = libDe._getStats(this._ctx)
+    const f64 = p >> 3
+    const i32 = p >> 2
+    const h = heap()
+    const u32 = h.u32
+    const timings = {}
+    STATS_HIST_NAMES.forEach((name, i) => {
+      timings[name] = readHistogram(u32, i32 + STATS_HIST + i * STATS_HIST_BUCKETS)
+    })
     return {
-      width, 
-      height,
-      data
+      decodeLatency: h.f64[f64 + STATS_DECODE_LATENCY],
+      avgDecodeLatency: h.f64[f64 + STATS_AVG_DECODE_LATENCY],
+      timeToFirstFrame: h.f64[f64 + STATS_TIME_TO_FIRST_FRAME],
+      reorderDelay: h.i32[i32 + STATS_REORDER_DELAY],
+      threadDelay: h.i32[i32 + STATS_THREAD_DELAY],
+      live: h.i32[i32 + STATS_LOW_DELAY] !== 0,
+      autoSkip: AUTO_SKIP_NAMES[h.i32[i32 + STATS_AUTO_SKIP]] || 'none',
+      cpuLoad: h.i32[i32 + STATS_CPU_LOAD],
+      bytesIn: u32[i32 + STATS_BYTES_IN] + u32[i32 + STATS_BYTES_IN + 1] * 0x100000000,
+      packets: u32[i32 + STATS_PACKETS],
+      framesDecoded: u32[i32 + STATS_FRAMES_DECODED],
+      framesConverted: u32[i32 + STATS_FRAMES_CONVERTED],
+      framesDelivered: u32[i32 + STATS_FRAMES_DELIVERED],
+      framesDropped: u32[i32 + STATS_FRAMES_DROPPED],
+      inputQueue: u32[i32 + STATS_INPUT_QUEUE] + this._pendingBytes(),
+      frameQueue: u32[i32 + STATS_FRAME_QUEUE],
+      timings
+    }
+  }
+
+  // 设置丢帧模式，可以随时调用，从下一个包开始生效
+  // mode: 'none'(默认，全解) | 'nonref'(不解非参考帧) | 'keyframe'(只解关键帧)
+  // 或者 { frame, loopFilter, idct }，取值 'none' | 'default' | 'nonref' | 'bidir' | 'nonintra' | 'nonkey' | 'all'
+  // 丢得更多的立刻生效，放宽(比如从 keyframe 切回 none)等到下一个关键帧才生效
+  setSkipMode(mode) {
+    if (!this._ctx) {
+      log('error', 'no _ctx when setSkipMode')
+      return
+    }
+    const m = typeof mode === 'string' ? SKIP_MODES[mode] : mode
+    if (!m) {
+      log('error', 'not support skip mode:', mode)
+      return
+    }
+    libDe._setSkipMode(this._ctx, discardToInt(m.frame), discardToInt(m.loopFilter), discardToInt(m.idct))
+  }
+
+  // 设置调度参数，可以随时调用，所有解码器共用解码线程，忙不过来时按这个分
+  // opts.priority: 优先级，数字，大的先解，默认 0，前台的画面给高优先级
+  // opts.deadline: 有数据之后最多等多久(ms)开始解，默认 100，同优先级的截止时间早的先解
+  // opts.budget: cpu 预算，占一个线程时间的百分比，超了自动丢帧，默认不限
+  // 不是最高优先级的解码器来不及解时会自动降级到 'nonref'，再不行 'keyframe'，空闲了再恢复，getStats().autoSkip 可以看到
+  setSchedule(opts) {
+    if (!this._ctx) {
+      log('error', 'no _ctx when setSchedule')
+      return
+    }
+    opts = opts || {}
+    libDe._setSchedule(this._ctx, opts.priority | 0, +opts.deadline || 0, opts.budget | 0)
+  }
+
+  // 设置输出尺寸，可以随时调用，从下一帧开始生效
+  // width/height 都不给表示原尺寸，只给一边时按比例算另一边
+  // filter: 'fast-bilinear'(默认) | 'bilinear' | 'area'
+  setOutputSize(width, height, filter) {
+    if (!this._ctx) {
+      log('error', 'no _ctx when setOutputSize')
+      return
+    }
+    const r = libDe._setOutputSize(this._ctx, width | 0, height | 0, scaleFilterToInt(filter))
+    if (r < 0) {
+      log('error', 'setOutputSize fail', width, height, filter)
+    }
+  }
+
+  // 设置输出格式 'rgba' | 'bgra' | 'i420'，可以随时调用，从下一帧开始生效
+  setOutputFormat(format) {
+    if (!this._ctx) {
+      log('error', 'no _ctx when setOutputFormat')
+      return
+    }
+    const r = libDe._setOutputFormat(this._ctx, outputFormatToInt(format))
+    if (r < 0) {
+      log('error', 'setOutputFormat fail', format)
     }
   }
 
@@ -11,8 +11,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <math.h>
 
 #include <pthread.h>
+#include <emscripten.h>
+#include <emscripten/threading.h>
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -99,14 +105,59 @@ static void log_fmts(int level) {
 
 typedef int (*IOReadCallback)(void *opaque, unsigned char* buf, int buf_size);
 
+// 输出的一帧，js 按偏移读 width/height/data，前面几个字段的顺序不要改
+typedef struct _Frame Frame;
+struct _Frame {
+	int width;
+	int height;
+	unsigned char *data;	// 图像数据，rgba 时是整张图，yuv 时和 planes[0] 一样
+	int format;				// OUTPUT_FORMAT_*
+	unsigned char *planes[3];	// yuv 时的 y/u/v 平面
+	int strides[3];			// 每个平面一行的字节数，rgba 时只有 strides[0]
+	double pts;				// 显示时间(ms)，put 时给的时间戳经过解码器重排序后的值，没有时是 NaN
+	double duration;		// 帧时长(ms)，按码流 VUI 里的帧率算，没有时是 0
+	// 以下 js 不用
+	Frame *next;			// 在帧池的空闲链表里时用
+	double inputTime;		// 这一帧的数据进解码器的时间(ms)，统计用
+	double queuedAt;		// 进输出队列的时间(ms)，统计用
+	int size;				// data 的大小，和帧池当前大小不一样的直接释放
+	AVFrame *ref;			// yuv 输出时直接引用解码器的 AVFrame，还回帧池时 unref
+};
+
+// 输出格式
+#define OUTPUT_FORMAT_RGBA	0	// 转成 rgba，一个像素 4 字节
+#define OUTPUT_FORMAT_I420	1	// yuv420p 三个平面，不转格式，给 WebGL 之类自己转
+#define OUTPUT_FORMAT_BGRA	2	// 转成 bgra，一个像素 4 字节
+
+// 缩放输出时的算法
+#define SCALE_FILTER_FAST_BILINEAR	0	// 最快，质量一般
+#define SCALE_FILTER_BILINEAR		1
+#define SCALE_FILTER_AREA			2	// 缩小很多时效果最好
+
+// 输出尺寸，要在转格式时直接缩放到这个尺寸
 typedef struct {
 	int width;
 	int height;
-	unsigned char buf[];
-} Frame;
+	int swsFlags;
+} OutputSize;
+
+// Frame 头占的大小，data 紧跟在后面，按 64 字节对齐
+#define FRAME_HEADER_SIZE	((sizeof(Frame) + 63) & ~63)
+
+// 帧池，按当前分辨率复用输出帧的内存，分辨率变了才重建
+typedef struct {
+	Frame *free;			// 空闲链表
+	int count;				// 空闲的个数
+	int size;				// 当前每帧 data 的大小
+	pthread_mutex_t mutex;	// 解码线程取，js 线程还
+} FramePool;
 
+// 有新帧时在主线程调用，frame 只在回调期间有效，回调返回后还回帧池
 typedef void (*FrameCallback)(void *opaque, Frame *frame);
 
+#define FRAME_CB_DELIVER	0	// 回调里逐帧给出队列里的帧
+#define FRAME_CB_NOTIFY		1	// 只通知有新帧，frame 为 NULL，帧留在队列里自己取，'block' 时没取走就不再解
+
 // 链表，用来存buf
 typedef struct _BufferList BufferList;
 struct _BufferList
@@ -114,277 +165,2141 @@ struct _BufferList
 	BufferList *next;
 	unsigned char *buf;
 	int len;
+	int flags;	// BUFFER_FLAG_*
+	int64_t pts;	// 时间戳，TIME_BASE 为单位，没有时是 AV_NOPTS_VALUE
+	int64_t dts;
+	double putTime;	// putBuffer 的时间(ms)，统计用
+};
+
+// putBuffer 的选项
+#define BUFFER_FLAG_END_OF_AU	1	// 这段数据以一个完整的 AU(一帧) 结尾，parser 不用等下一个起始码，立刻出包
+#define BUFFER_FLAG_FLUSH		2	// 流结束，解码器里攒着的帧全部输出，然后重置，可以接着解下一段流
+#define BUFFER_FLAG_KEY_FRAME	4	// putPacket 时表示这个包是关键帧
+#define BUFFER_FLAG_PACKET		8	// 这段数据是一个完整的包(AU)，不经过 parser 直接送去解码，putPacket 用
+
+// 送进解码器的时间戳的单位(us)，js 那边用 ms
+#define TIME_BASE		1000000
+#define TIME_PER_MS		1000
+
+// 环形缓冲的标记，记录一段数据的范围、时间戳和 BUFFER_FLAG_*，js 按偏移写，字段顺序不要改
+// 只有带时间戳或 flags 的数据才写标记
+#define RING_MARK_COUNT	64
+typedef struct {
+	double pts;		// 时间戳(ms)，没有时是 NaN
+	double dts;
+	uint32_t start;	// 这段数据开始和结束的位置，和 head/tail 一样是字节计数
+	uint32_t end;
+	int flags;		// BUFFER_FLAG_*
+	int reserved;
+} RingMark;
+
+// js 给的时间戳(ms，NaN 表示没有)转成 TIME_BASE
+static int64_t msToTs(double ms) {
+	return isnan(ms) ? AV_NOPTS_VALUE : llrint(ms * TIME_PER_MS);
+}
+
+// 输出队列满了之后的处理方式
+#define FRAME_POLICY_BLOCK			0	// 暂停这个解码器，等取走了再继续解，解码线程去解别的
+#define FRAME_POLICY_DROP_OLDEST	1	// 丢掉最老的一帧
+#define FRAME_POLICY_LATEST			2	// 只保留最新的一帧，用于实时监控
+
+#define DEFAULT_FRAME_QUEUE_DEPTH	8	// 输出队列的默认长度
+
+// 单生产者(js)单消费者(解码线程)的输入环形缓冲，js 直接往 data 里写，不用 malloc 也不加锁
+// head/tail 是单调递增的字节计数(会回绕)，& (size - 1) 得到在 data 里的位置
+// js 那边按偏移读写这个结构，字段顺序不要改
+typedef struct {
+	volatile uint32_t head;	// 已写入的字节数，只由 js 修改(Atomics.store)
+	volatile uint32_t tail;	// 已消费的字节数，只由解码线程修改
+	uint32_t size;			// 容量，2的幂
+	uint8_t *data;			// 数据区，后面多留 AV_INPUT_BUFFER_PADDING_SIZE 给 parser
+	volatile int *wake;		// 写完后对这个地址 Atomics.add + Atomics.notify，唤醒解码线程
+	volatile uint32_t markHead;	// 已写入的标记数，只由 js 修改，要在写 head 之前写
+	volatile uint32_t markTail;	// 已处理的标记数，只由解码线程修改
+	uint32_t markCount;		// 标记的个数 RING_MARK_COUNT
+	RingMark marks[RING_MARK_COUNT];	// 只有带 flags 的数据才写标记
+} InputRing;
+
+// sws 缓存，一个 key 一个 sws，解码器里的格式/尺寸/色彩空间变了不用重建
+#define SWS_CACHE_SIZE	4
+typedef struct {
+	struct SwsContext* sws;
+	int srcW, srcH, srcFormat;
+	int dstW, dstH, dstFormat;
+	int flags;
+	int colorspace, fullRange;
+	unsigned lastUse;
+} SwsCacheEntry;
+
+// 各阶段耗时的直方图，第 i 格是 [2^i, 2^(i+1)) us，第 0 格是 2us 以下，最后一格是更长的
+#define STATS_HIST_BUCKETS	20
+#define STATS_HIST_PARSE		0	// 每次 av_parser_parse2 的时间
+#define STATS_HIST_DECODE		1	// 每个包 avcodec_send_packet 的时间
+#define STATS_HIST_CONVERT		2	// 每帧转格式的时间
+#define STATS_HIST_QUEUE_WAIT	3	// 帧在输出队列里等着被取走的时间
+#define STATS_HIST_PUT_TO_GET	4	// 从数据进解码器到这一帧被取走的时间
+#define STATS_HIST_COUNT		5
+
+// 解码器的统计信息，js 按偏移读，字段顺序不要改
+// 前面的只有解码线程写，js 读到的可能不是同一时刻的，只用来看
+// 计数和直方图在各个线程里原子加(relaxed)，不加锁，js 读到的是近似值
+typedef struct {
+	double decodeLatency;		// 最近一帧从送进解码器到解出来的时间(ms)
+	double avgDecodeLatency;	// 上面的指数滑动平均
+	double firstInputTime;		// 解码线程第一次读到数据的时间(ms)
+	double timeToFirstFrame;	// 从第一次读到数据到第一帧进输出队列的时间(ms)，还没出帧时是 0
+	int reorderDelay;			// 解码器因为帧重排序要多攒的帧数(has_b_frames)
+	int threadDelay;			// 帧级多线程要多攒的帧数
+	int lowDelay;				// 是否是 live 模式
+	volatile int flushCount;	// 已经完成的 flush 次数，js 用来判断 flush 的帧是否都进了输出队列
+	int autoSkip;				// 调度器自动降级的丢帧等级 AUTO_SKIP_*
+	int cpuLoad;				// 最近一个统计周期里解码占一个线程时间的百分比
+	volatile uint64_t bytesIn;	// 已经送进 parser/解码器的字节数
+	volatile uint32_t packets;	// 送进解码器的包数
+	volatile uint32_t framesDecoded;	// 解码器输出的帧数
+	volatile uint32_t framesConverted;	// 转好格式进了输出队列的帧数
+	volatile uint32_t framesDelivered;	// 被 getFrame/getFrames/回调取走的帧数
+	volatile uint32_t framesDropped;	// 输出队列满了或者改小了丢掉的帧数
+	uint32_t inputQueue;		// 还没处理的输入字节数，getStats 时更新
+	uint32_t frameQueue;		// 输出队列里的帧数，getStats 时更新
+	volatile uint32_t hist[STATS_HIST_COUNT][STATS_HIST_BUCKETS];	// 各阶段耗时 STATS_HIST_*
+} DecoderStats;
+
+#define STATS_ADD(de, field, n)	__atomic_add_fetch(&(de)->stats.field, (n), __ATOMIC_RELAXED)
+
+// 记一次耗时(ms)到直方图
+static void statsRecord(DecoderStats* st, int hist, double ms) {
+	int us = ms > 0 ? (int)(ms * 1000) : 0;
+	int bucket = us > 1 ? 31 - __builtin_clz(us) : 0;
+	if (bucket >= STATS_HIST_BUCKETS) {
+		bucket = STATS_HIST_BUCKETS - 1;
+	}
+	__atomic_add_fetch(&st->hist[hist][bucket], 1, __ATOMIC_RELAXED);
+}
+
+typedef struct {
+	IOReadCallback io_read_cb;	// 读数据的回调
+	AVIOContext* io_ctx;	// avio
+	size_t io_buffer_size;	// 缓存(avio用的)大小
+	uint8_t* io_buffer;		// 缓存(avio用的)
+	AVInputFormat* input_format;	// 封装格式
+	AVFormatContext* fmt; 	// 流封装
+	AVCodecParserContext* parser;	// 相当于fmt
+	int parserAligned;		// parser 里没有攒着数据(刚开始，或者上一块输入以完整的 AU 结尾并且已经送出去了)
+	AVCodec* codec;			// 编码
+	int stream_index;		// 视频流的序号
+	AVCodecContext* ctx;	// 解码句柄
+	AVPacket* packet;		// 数据帧
+	// 阻塞模式下输出队列满了，解码线程不等，把没做完的记下来，getFrame 取走帧后由 pumpDecoder 接着做
+	AVPacket* heldPacket;	// 没送进解码器的包
+	int held;				// heldPacket 里有包
+	int pendingFlags;		// 包没送进去时推迟处理的一段数据的 flags
+	int drainState;			// 流结束的 drain 做到哪一步 DRAIN_*
+	int outputPending;		// 解码器里还有没取出来的帧
+	int bufferOffset;		// bufferList 第一块已经 parse 过的字节数
+	AVFrame* frameYUV;		// 解出的图片帧
+	AVFrame* frameRGBA;		// 解出的图片帧
+	AVFrame* frameNext;		// 队列只留一帧时看解码器里紧跟着还有没有帧，有就跳过 frameYUV 不转
+	SwsCacheEntry swsCache[SWS_CACHE_SIZE];	// 转格式用的 sws，按格式/尺寸缓存
+	unsigned swsUse;		// sws 缓存的使用计数，淘汰最久没用的
+	uint8_t* scratch;		// 转格式用的临时行缓存，每段一份
+	int scratchSize;
+	uint8_t* packetScratch;	// 环形缓冲里跨过环尾的包拼在这里
+	unsigned int packetScratchSize;
+	int width;				// 图像宽度
+	int height;				// 图像高度
+	int found_info;			// 找到流信息
+	int offset;				// 已经处理过的数据
+	Frame* latestFrame;	// 最新的一帧解码结果
+	FrameCallback frameCb;	// 有新帧时在主线程调用，NULL 时只能用 getFrame 取
+	void *frameCbOpaque;
+	int frameCbMode;		// FRAME_CB_*
+	volatile int notifyPending;	// 已经发给主线程还没执行的通知，最多一个
+	int delivering;			// 主线程正在调用回调
+	int zombie;				// 已经 releaseDecoder 了，但还有通知没执行或者在回调里，等通知执行完再释放
+	volatile int busy;		// 正在被解码线程池里的某个线程处理，池的 mutex 保护
+	int registered;			// 已经加进解码线程池
+	// 以下是调度用的，池的 mutex 保护
+	int priority;			// 优先级，大的先解，只有最高优先级以下的会因为来不及被自动降级
+	double deadline;		// 有数据之后最多等多久(ms)开始解，同优先级的按截止时间先后解
+	double budget;			// cpu 预算，占一个线程时间的比例，超了就自动降级，0 表示不限
+	double readySince;		// 从什么时候开始有数据等着解，0 表示没有
+	double busyTime;		// 这个统计周期里解码用的时间(ms)
+	double windowStart;		// 统计周期的开始时间
+	int missed;				// 这个统计周期里错过截止时间的次数
+	int autoSkip;			// 调度器自动降级的丢帧等级 AUTO_SKIP_*，和 skipMode 取更狠的那个
+	pthread_mutex_t bufferMutex;
+	pthread_mutex_t frameMutex;
+	BufferList *bufferHead;
+	BufferList *bufferTail;
+	volatile uint32_t bufferBytes;	// bufferList 里还没处理的字节数
+	double chunkTime;		// 正在处理的这块输入进解码器的时间(ms)，parser 出的包用这个时间
+	Frame **frameQueue;		// 输出队列，循环数组，frameMutex 保护
+	int frameDepth;			// 队列长度
+	int frameStart;			// 队头位置
+	int frameCount;			// 队列里的帧数
+	int framePolicy;		// 队列满了之后的处理方式 FRAME_POLICY_*
+	FramePool pool;			// 输出帧的内存池
+	volatile int outputFormat;	// 输出格式 OUTPUT_FORMAT_*，可以随时改
+	volatile int skipMode;	// 要求的丢帧模式，skip_frame/skip_loop_filter/skip_idct 三个 AVDISCARD_* 各占一个字节
+	int appliedSkipMode;	// 已经设置到 ctx 上的，只有解码线程用
+	int keyFlagSeen;		// 送过带关键帧标记的包，放宽丢帧模式时可以等关键帧，只有解码线程用
+	DecoderStats stats;		// 统计信息
+	volatile int64_t outputSize;	// 要求的输出尺寸，宽(16位)|高(16位)|算法，0 表示原尺寸，一起原子读写
+	InputRing *ring;		// 输入环形缓冲，没有启用时为 NULL，走 bufferList
+	volatile int needStop; // 要结束 
+} Decoder;
+
+// 创建解码器时的选项
+#define DECODER_FLAG_LIVE	1	// 实时模式：低延迟，用 slice 多线程，解出来立刻输出不等重排序
+
+// 解码器内部多线程的方式，和 FF_THREAD_FRAME / FF_THREAD_SLICE 对应
+#define DECODER_THREAD_FRAME	FF_THREAD_FRAME	// 帧级并行，吞吐高，但会多出 threadCount-1 帧的延迟
+#define DECODER_THREAD_SLICE	FF_THREAD_SLICE	// slice/WPP 并行，不增加延迟，依赖码流里有多个 slice 或开了 WPP
+
+static void freeFrame(Frame* frame) {
+	if (frame->ref) {
+		av_frame_free(&frame->ref);
+	}
+	av_free(frame);
+}
+
+// 从帧池取一帧，size 和池里的不一样说明分辨率变了，清空重建
+static Frame* acquireFrame(Decoder* de, int size) {
+	FramePool *pool = &de->pool;
+	Frame *f = NULL;
+	Frame *stale = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->size != size) {
+		stale = pool->free;
+		pool->free = NULL;
+		pool->count = 0;
+		pool->size = size;
+	}
+	f = pool->free;
+	if (f) {
+		pool->free = f->next;
+		pool->count--;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	while (stale) {
+		Frame *next = stale->next;
+		freeFrame(stale);
+		stale = next;
+	}
+	if (!f) {
+		f = av_malloc(FRAME_HEADER_SIZE + size);
+		if (!f) {
+			av_log(NULL, AV_LOG_ERROR, "av_malloc err: %d\n", size);
+			return NULL;
+		}
+		memset(f, 0, sizeof(Frame));
+		f->data = (unsigned char*)f + FRAME_HEADER_SIZE;
+		f->size = size;
+	}
+	f->next = NULL;
+	return f;
+}
+
+// 还回帧池，js 用完 getFrame 拿到的帧之后调用
+// 池里最多留 frameDepth + 2 帧，多的和旧分辨率的直接释放
+void releaseFrame(void *ctx, Frame* frame) {
+	if (!ctx || !frame) {
+		return;
+	}
+	Decoder* de = (Decoder*)ctx;
+	FramePool *pool = &de->pool;
+	if (frame->ref) {
+		av_frame_unref(frame->ref);
+	}
+	pthread_mutex_lock(&pool->mutex);
+	if (frame->size == pool->size && pool->count < de->frameDepth + 2) {
+		frame->next = pool->free;
+		pool->free = frame;
+		pool->count++;
+		frame = NULL;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	if (frame) {
+		freeFrame(frame);
+	}
+}
+
+// 一次还多帧，只加一次锁
+void releaseFrames(void *ctx, Frame** frames, int n) {
+	if (!ctx || !frames) {
+		return;
+	}
+	Decoder* de = (Decoder*)ctx;
+	FramePool *pool = &de->pool;
+	for (int i = 0; i < n; i++) {
+		if (frames[i] && frames[i]->ref) {
+			av_frame_unref(frames[i]->ref);
+		}
+	}
+	Frame *dropped = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	for (int i = 0; i < n; i++) {
+		Frame *frame = frames[i];
+		if (!frame) {
+			continue;
+		}
+		if (frame->size == pool->size && pool->count < de->frameDepth + 2) {
+			frame->next = pool->free;
+			pool->free = frame;
+			pool->count++;
+		} else {
+			frame->next = dropped;
+			dropped = frame;
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	while (dropped) {
+		Frame *next = dropped->next;
+		freeFrame(dropped);
+		dropped = next;
+	}
+}
+
+// 释放帧池
+static void destroyFramePool(Decoder* de) {
+	FramePool *pool = &de->pool;
+	while (pool->free) {
+		Frame *next = pool->free->next;
+		freeFrame(pool->free);
+		pool->free = next;
+	}
+	pool->count = 0;
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+// ==== yuv -> rgba/bgra 转换，不走 swscale ====
+// 支持 yuv420p/yuv422p 和它们的 10 bit 版本，10 bit 的先查表转成 8 bit
+// 定点系数，Q13，yuv 的 u/v 先减 128，y 先减 yOffset
+// 标量和 simd 版本的算法完全一样(32 位整数乘加，最后截断到 0~255)，结果逐位一致
+#define YUV_SHIFT	13
+#define YUV_ROUND	(1 << (YUV_SHIFT - 1))
+
+typedef struct {
+	int yOffset;	// 16(limited) 或 0(full)
+	int yMul;		// y 的系数
+	int vr;			// r = y + vr*v
+	int ug, vg;		// g = y + ug*u + vg*v
+	int ub;			// b = y + ub*u
+} YuvCoeffs;
+
+static const YuvCoeffs kYuvBT601Limited = { 16, 9539, 13075, -3209, -6660, 16525 };
+static const YuvCoeffs kYuvBT709Limited = { 16, 9539, 14686, -1747, -4366, 17305 };
+static const YuvCoeffs kYuvBT601Full = { 0, 8192, 11485, -2819, -5850, 14516 };
+static const YuvCoeffs kYuvBT709Full = { 0, 8192, 12901, -1535, -3835, 15201 };
+static const YuvCoeffs kYuvBT2020Limited = { 16, 9539, 13752, -1535, -5328, 17545 };
+static const YuvCoeffs kYuvBT2020Full = { 0, 8192, 12080, -1348, -4681, 15412 };
+
+static int isFullRange(const AVFrame* frame) {
+	return frame->color_range == AVCOL_RANGE_JPEG || 
+		frame->format == AV_PIX_FMT_YUVJ420P || frame->format == AV_PIX_FMT_YUVJ422P;
+}
+
+// 按帧的色彩空间和范围选系数，没有标明的按 BT.601
+static const YuvCoeffs* yuvCoeffsOf(const AVFrame* frame) {
+	int full = isFullRange(frame);
+	switch (frame->colorspace) {
+		case AVCOL_SPC_BT709:
+			return full ? &kYuvBT709Full : &kYuvBT709Limited;
+		case AVCOL_SPC_BT2020_NCL:
+		case AVCOL_SPC_BT2020_CL:
+			return full ? &kYuvBT2020Full : &kYuvBT2020Limited;
+		default:
+			break;
+	}
+	return full ? &kYuvBT601Full : &kYuvBT601Limited;
+}
+
+// 原生转换支持的源格式
+typedef struct {
+	int chromaShift;	// 色度纵向下采样，420 是 1，422 是 0
+	int depth10;		// 10 bit，先查表转成 8 bit
+} NativeFormat;
+
+// 能不能用原生转换，不能的走 swscale
+static int nativeFormatOf(int format, NativeFormat* nf) {
+	switch (format) {
+		case AV_PIX_FMT_YUV420P:
+		case AV_PIX_FMT_YUVJ420P:
+			nf->chromaShift = 1;
+			nf->depth10 = 0;
+			return 1;
+		case AV_PIX_FMT_YUV422P:
+		case AV_PIX_FMT_YUVJ422P:
+			nf->chromaShift = 0;
+			nf->depth10 = 0;
+			return 1;
+		case AV_PIX_FMT_YUV420P10LE:
+			nf->chromaShift = 1;
+			nf->depth10 = 1;
+			return 1;
+		case AV_PIX_FMT_YUV422P10LE:
+			nf->chromaShift = 0;
+			nf->depth10 = 1;
+			return 1;
+		default:
+			break;
+	}
+	return 0;
+}
+
+// 10 bit 转 8 bit 的表，四舍五入
+static uint8_t g_depth10To8[1024];
+static pthread_once_t g_depth10Once = PTHREAD_ONCE_INIT;
+
+static void initDepth10Table(void) {
+	int i;
+	for (i = 0; i < 1024; i++) {
+		int v = (i + 2) >> 2;
+		g_depth10To8[i] = v > 255 ? 255 : v;
+	}
+}
+
+static void depth10To8Row(const uint8_t* src, uint8_t* dst, int n) {
+	const uint16_t* s = (const uint16_t*)src;
+	int i;
+	for (i = 0; i < n; i++) {
+		dst[i] = g_depth10To8[s[i] & 1023];
+	}
+}
+
+static inline uint8_t clipU8(int v) {
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// 标量版本，处理 [x, width) 的像素
+static void yuv2rgbaRowC(const uint8_t* py, const uint8_t* pu, const uint8_t* pv, uint8_t* dst, 
+	int x, int width, const YuvCoeffs* c, int bgra) {
+	int ri = bgra ? 2 : 0;
+	int bi = bgra ? 0 : 2;
+	for (; x < width; x++) {
+		int yy = (py[x] - c->yOffset) * c->yMul + YUV_ROUND;
+		int u = pu[x >> 1] - 128;
+		int v = pv[x >> 1] - 128;
+		uint8_t* d = dst + (x << 2);
+		d[ri] = clipU8((yy + c->vr * v) >> YUV_SHIFT);
+		d[1] = clipU8((yy + c->ug * u + c->vg * v) >> YUV_SHIFT);
+		d[bi] = clipU8((yy + c->ub * u) >> YUV_SHIFT);
+		d[3] = 255;
+	}
+}
+
+#ifdef __wasm_simd128__
+// 8 个像素的一个通道：(yy + ca*a + cb*b) >> YUV_SHIFT，yy 已经乘过系数加过 round
+static inline v128_t yuvChannel(v128_t yyLo, v128_t yyHi, v128_t a, v128_t ca, v128_t b, v128_t cb) {
+	v128_t lo = wasm_i32x4_add(yyLo, wasm_i32x4_extmul_low_i16x8(a, ca));
+	v128_t hi = wasm_i32x4_add(yyHi, wasm_i32x4_extmul_high_i16x8(a, ca));
+	lo = wasm_i32x4_add(lo, wasm_i32x4_extmul_low_i16x8(b, cb));
+	hi = wasm_i32x4_add(hi, wasm_i32x4_extmul_high_i16x8(b, cb));
+	return wasm_i16x8_narrow_i32x4(wasm_i32x4_shr(lo, YUV_SHIFT), wasm_i32x4_shr(hi, YUV_SHIFT));
+}
+
+// simd 版本，一次 16 个像素，剩下的交给标量版本
+static void yuv2rgbaRow(const uint8_t* py, const uint8_t* pu, const uint8_t* pv, uint8_t* dst, 
+	int width, const YuvCoeffs* c, int bgra) {
+	const v128_t yOffset = wasm_i16x8_splat(c->yOffset);
+	const v128_t uvOffset = wasm_i16x8_splat(128);
+	const v128_t yMul = wasm_i16x8_splat(c->yMul);
+	const v128_t vr = wasm_i16x8_splat(c->vr);
+	const v128_t ug = wasm_i16x8_splat(c->ug);
+	const v128_t vg = wasm_i16x8_splat(c->vg);
+	const v128_t ub = wasm_i16x8_splat(c->ub);
+	const v128_t zero = wasm_i16x8_splat(0);
+	const v128_t round = wasm_i32x4_splat(YUV_ROUND);
+	const v128_t alpha = wasm_i8x16_splat(-1);
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		v128_t y8 = wasm_v128_load(py + x);
+		v128_t u = wasm_i16x8_sub(wasm_u16x8_load8x8(pu + (x >> 1)), uvOffset);
+		v128_t v = wasm_i16x8_sub(wasm_u16x8_load8x8(pv + (x >> 1)), uvOffset);
+		v128_t yl = wasm_i16x8_sub(wasm_u16x8_extend_low_u8x16(y8), yOffset);
+		v128_t yh = wasm_i16x8_sub(wasm_u16x8_extend_high_u8x16(y8), yOffset);
+		// 一个 u/v 对应两个像素
+		v128_t ul = wasm_i16x8_shuffle(u, u, 0, 0, 1, 1, 2, 2, 3, 3);
+		v128_t uh = wasm_i16x8_shuffle(u, u, 4, 4, 5, 5, 6, 6, 7, 7);
+		v128_t vl = wasm_i16x8_shuffle(v, v, 0, 0, 1, 1, 2, 2, 3, 3);
+		v128_t vh = wasm_i16x8_shuffle(v, v, 4, 4, 5, 5, 6, 6, 7, 7);
+
+		v128_t yyLL = wasm_i32x4_add(wasm_i32x4_extmul_low_i16x8(yl, yMul), round);
+		v128_t yyLH = wasm_i32x4_add(wasm_i32x4_extmul_high_i16x8(yl, yMul), round);
+		v128_t yyHL = wasm_i32x4_add(wasm_i32x4_extmul_low_i16x8(yh, yMul), round);
+		v128_t yyHH = wasm_i32x4_add(wasm_i32x4_extmul_high_i16x8(yh, yMul), round);
+
+		v128_t r = wasm_u8x16_narrow_i16x8(
+			yuvChannel(yyLL, yyLH, vl, vr, ul, zero),
+			yuvChannel(yyHL, yyHH, vh, vr, uh, zero));
+		v128_t g = wasm_u8x16_narrow_i16x8(
+			yuvChannel(yyLL, yyLH, ul, ug, vl, vg),
+			yuvChannel(yyHL, yyHH, uh, ug, vh, vg));
+		v128_t b = wasm_u8x16_narrow_i16x8(
+			yuvChannel(yyLL, yyLH, ul, ub, vl, zero),
+			yuvChannel(yyHL, yyHH, uh, ub, vh, zero));
+		if (bgra) {
+			v128_t t = r;
+			r = b;
+			b = t;
+		}
+		// 交织成 rgba
+		v128_t rg0 = wasm_i8x16_shuffle(r, g, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+		v128_t rg1 = wasm_i8x16_shuffle(r, g, 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+		v128_t ba0 = wasm_i8x16_shuffle(b, alpha, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+		v128_t ba1 = wasm_i8x16_shuffle(b, alpha, 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+		uint8_t* d = dst + (x << 2);
+		wasm_v128_store(d, wasm_i16x8_shuffle(rg0, ba0, 0, 8, 1, 9, 2, 10, 3, 11));
+		wasm_v128_store(d + 16, wasm_i16x8_shuffle(rg0, ba0, 4, 12, 5, 13, 6, 14, 7, 15));
+		wasm_v128_store(d + 32, wasm_i16x8_shuffle(rg1, ba1, 0, 8, 1, 9, 2, 10, 3, 11));
+		wasm_v128_store(d + 48, wasm_i16x8_shuffle(rg1, ba1, 4, 12, 5, 13, 6, 14, 7, 15));
+	}
+	yuv2rgbaRowC(py, pu, pv, dst, x, width, c, bgra);
+}
+#else
+static void yuv2rgbaRow(const uint8_t* py, const uint8_t* pu, const uint8_t* pv, uint8_t* dst, 
+	int width, const YuvCoeffs* c, int bgra) {
+	yuv2rgbaRowC(py, pu, pv, dst, 0, width, c, bgra);
+}
+#endif
+
+// 转 [y0, y1) 这些行，src 的格式要是 nativeFormatOf 支持的
+// 10 bit 时 scratch 要有 width + 2 * ((width + 1) / 2) 字节
+static void yuv2rgba(const AVFrame* src, uint8_t* dst, int dstStride, int y0, int y1, 
+	const YuvCoeffs* c, int bgra, const NativeFormat* nf, uint8_t* scratch) {
+	int width = src->width;
+	int cw = (width + 1) >> 1;
+	int y;
+	for (y = y0; y < y1; y++) {
+		const uint8_t* py = src->data[0] + y * src->linesize[0];
+		const uint8_t* pu = src->data[1] + (y >> nf->chromaShift) * src->linesize[1];
+		const uint8_t* pv = src->data[2] + (y >> nf->chromaShift) * src->linesize[2];
+		if (nf->depth10) {
+			depth10To8Row(py, scratch, width);
+			depth10To8Row(pu, scratch + width, cw);
+			depth10To8Row(pv, scratch + width + cw, cw);
+			py = scratch;
+			pu = scratch + width;
+			pv = scratch + width + cw;
+		}
+		yuv2rgbaRow(py, pu, pv, dst + y * dstStride, width, c, bgra);
+	}
+}
+
+// ==== 转格式用的线程池，所有解码器共用 ====
+// 一帧按行切成几段，解码线程自己也做一段，其他的分给池里的线程
+#define CONVERT_MAX_THREADS	8
+#define CONVERT_MIN_ROWS	64	// 每段至少这么多行，太小的图不值得分
+
+typedef struct _ConvertJob ConvertJob;
+struct _ConvertJob {
+	void (*fun)(void *arg, int band, int bands);	// 做第 band 段
+	void *arg;
+	int bands;				// 总段数
+	int next;				// 下一个要领的段，池的 mutex 保护
+	volatile int done;		// 做完的段数，等待用的 futex
+	ConvertJob *queueNext;
+};
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	ConvertJob *head;		// 还有段没领完的任务
+	ConvertJob *tail;
+	int threads;			// 已启动的线程数
+	int limit;				// 分段时最多用几个池里的线程，setConvertThreads 可以改小
+	volatile int started;	// 已经按默认值或 setConvertThreads 启动过
+	pthread_t tids[CONVERT_MAX_THREADS];
+} ConvertPool;
+
+static ConvertPool g_convertPool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0 };
+
+// 从队头的任务领一段，要持有 mutex，领完了就出队。返回 -1 表示没有
+static int claimBandLocked(ConvertPool *pool, ConvertJob *job) {
+	if (job->next >= job->bands) {
+		return -1;
+	}
+	int band = job->next++;
+	if (job->next >= job->bands) {
+		// 段都领完了，出队
+		ConvertJob **p = &pool->head;
+		ConvertJob *prev = NULL;
+		while (*p && *p != job) {
+			prev = *p;
+			p = &(*p)->queueNext;
+		}
+		if (*p) {
+			*p = job->queueNext;
+			if (pool->tail == job) {
+				pool->tail = prev;
+			}
+		}
+	}
+	return band;
+}
+
+// 计数和唤醒都在池的 mutex 里做：job 在 runBands 的栈上，runBands 看到做完之后
+// 还要再拿一次 mutex 才返回，这样返回时不会还有线程在唤醒已经回收的 job
+static void finishBand(ConvertPool *pool, ConvertJob *job) {
+	pthread_mutex_lock(&pool->mutex);
+	__atomic_add_fetch(&job->done, 1, __ATOMIC_SEQ_CST);
+	emscripten_futex_wake(&job->done, 1);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void *convertThreadFun(void *ctx) {
+	ConvertPool *pool = (ConvertPool*)ctx;
+	while (1) {
+		pthread_mutex_lock(&pool->mutex);
+		while (!pool->head) {
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+		ConvertJob *job = pool->head;
+		int band = claimBandLocked(pool, job);
+		pthread_mutex_unlock(&pool->mutex);
+		if (band >= 0) {
+			job->fun(job->arg, band, job->bands);
+			finishBand(pool, job);
+		}
+	}
+	return NULL;
+}
+
+// 启动到 n 个转格式线程，要持有 mutex，<=0 时按 cpu 核数 - 1，返回分段时会用的线程数
+static int startConvertThreadsLocked(ConvertPool *pool, int n) {
+	if (n <= 0) {
+		n = emscripten_num_logical_cores() - 1;
+	}
+	if (n > CONVERT_MAX_THREADS) {
+		n = CONVERT_MAX_THREADS;
+	}
+	pool->limit = n;
+	__atomic_store_n(&pool->started, 1, __ATOMIC_RELEASE);
+	while (pool->threads < n) {
+		int ret = pthread_create(&pool->tids[pool->threads], NULL, convertThreadFun, pool);
+		if (ret != 0) {
+			av_log(NULL, AV_LOG_ERROR, "pthread_create convert thread fail %d.\n", ret);
+			break;
+		}
+		pthread_detach(pool->tids[pool->threads]);
+		pool->threads++;
+	}
+	return pool->threads < n ? pool->threads : n;
+}
+
+// 设置转格式的线程数，<=0 时按 cpu 核数 - 1，返回分段时会用的线程数
+// 不调用的话第一次有值得分段的帧时按默认值启动；已经启动的线程不会退出，改小只是不再分给它们
+int setConvertThreads(int n) {
+	ConvertPool *pool = &g_convertPool;
+	pthread_mutex_lock(&pool->mutex);
+	n = startConvertThreadsLocked(pool, n);
+	pthread_mutex_unlock(&pool->mutex);
+	return n;
+}
+
+// 把 rows 行的工作分段并行做完，没有线程池或行数太少就直接在当前线程做
+static void runBands(void (*fun)(void *arg, int band, int bands), void *arg, int rows) {
+	ConvertPool *pool = &g_convertPool;
+	if (!__atomic_load_n(&pool->started, __ATOMIC_ACQUIRE) && rows >= CONVERT_MIN_ROWS * 2) {
+		// 第一次遇到值得分段的帧，没调用过 setConvertThreads 的按 cpu 核数启动
+		pthread_mutex_lock(&pool->mutex);
+		if (!pool->started) {
+			startConvertThreadsLocked(pool, 0);
+		}
+		pthread_mutex_unlock(&pool->mutex);
+	}
+	int threads = __atomic_load_n(&pool->threads, __ATOMIC_RELAXED);
+	int limit = __atomic_load_n(&pool->limit, __ATOMIC_RELAXED);
+	int bands = (threads < limit ? threads : limit) + 1;
+	if (bands > rows / CONVERT_MIN_ROWS) {
+		bands = rows / CONVERT_MIN_ROWS;
+	}
+	if (bands <= 1) {
+		fun(arg, 0, 1);
+		return;
+	}
+	ConvertJob job = { fun, arg, bands, 0, 0, NULL };
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->tail) {
+		pool->tail->queueNext = &job;
+	} else {
+		pool->head = &job;
+	}
+	pool->tail = &job;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	// 自己也领段来做
+	while (1) {
+		pthread_mutex_lock(&pool->mutex);
+		int band = claimBandLocked(pool, &job);
+		pthread_mutex_unlock(&pool->mutex);
+		if (band < 0) {
+			break;
+		}
+		job.fun(job.arg, band, job.bands);
+		finishBand(pool, &job);
+	}
+	// 等别的线程做完
+	while (1) {
+		int done = __atomic_load_n(&job.done, __ATOMIC_SEQ_CST);
+		if (done >= bands) {
+			break;
+		}
+		emscripten_futex_wait(&job.done, done, INFINITY);
+	}
+	// 最后一个 finishBand 可能还没放开 mutex，等它做完再回收 job
+	pthread_mutex_lock(&pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+// 分段转 rgba 的参数
+typedef struct {
+	const AVFrame* src;
+	uint8_t* dst;
+	int dstStride;
+	const YuvCoeffs* coeffs;
+	int bgra;
+	NativeFormat nf;
+	uint8_t* scratch;		// 每段一份临时行缓存，10 bit 时用
+	int scratchStride;
+} Yuv2RgbaJob;
+
+static void yuv2rgbaBand(void *arg, int band, int bands) {
+	Yuv2RgbaJob* job = (Yuv2RgbaJob*)arg;
+	int height = job->src->height;
+	yuv2rgba(job->src, job->dst, job->dstStride, height * band / bands, height * (band + 1) / bands, 
+		job->coeffs, job->bgra, &job->nf, job->scratch + band * job->scratchStride);
+}
+
+// 转格式的临时缓存，每段 stride 字节，够 CONVERT_MAX_THREADS + 1 段用
+static uint8_t* ensureScratch(Decoder* de, int stride) {
+	int size = stride * (CONVERT_MAX_THREADS + 1);
+	if (de->scratchSize < size) {
+		av_freep(&de->scratch);
+		de->scratchSize = 0;
+		de->scratch = av_malloc(size);
+		if (!de->scratch) {
+			av_log(NULL, AV_LOG_ERROR, "av_malloc scratch err: %d\n", size);
+			return NULL;
+		}
+		de->scratchSize = size;
+	}
+	return de->scratch;
+}
+
+// 取转格式用的 sws，按源格式/尺寸/色彩空间、输出格式/尺寸缓存，缓存满了淘汰最久没用的
+static struct SwsContext* getSws(Decoder* de, const AVFrame* src, int dstW, int dstH, enum AVPixelFormat dstFormat, int flags) {
+	int fullRange = isFullRange(src);
+	SwsCacheEntry* victim = &de->swsCache[0];
+	int i;
+	de->swsUse++;
+	for (i = 0; i < SWS_CACHE_SIZE; i++) {
+		SwsCacheEntry* e = &de->swsCache[i];
+		if (e->sws && e->srcW == src->width && e->srcH == src->height && e->srcFormat == src->format &&
+			e->dstW == dstW && e->dstH == dstH && e->dstFormat == dstFormat && e->flags == flags &&
+			e->colorspace == src->colorspace && e->fullRange == fullRange) {
+			e->lastUse = de->swsUse;
+			return e->sws;
+		}
+		if (!e->sws || (victim->sws && e->lastUse < victim->lastUse)) {
+			victim = e;
+		}
+	}
+	if (victim->sws) {
+		sws_freeContext(victim->sws);
+		victim->sws = NULL;
+	}
+	struct SwsContext* sws = sws_getContext(
+		src->width, src->height, src->format,
+		dstW, dstH, dstFormat,
+		flags, NULL, NULL, NULL);
+	if (!sws) {
+		av_log(NULL, AV_LOG_ERROR, "sws_getContext fail.");
+		return NULL;
+	}
+	// 按帧的色彩空间和范围转，不然都当 BT.601 limited
+	int dstFull = dstFormat == AV_PIX_FMT_RGBA || dstFormat == AV_PIX_FMT_BGRA ? 1 : fullRange;
+	sws_setColorspaceDetails(sws, sws_getCoefficients(src->colorspace), fullRange,
+		sws_getCoefficients(src->colorspace), dstFull, 0, 1 << 16, 1 << 16);
+	victim->sws = sws;
+	victim->srcW = src->width;
+	victim->srcH = src->height;
+	victim->srcFormat = src->format;
+	victim->dstW = dstW;
+	victim->dstH = dstH;
+	victim->dstFormat = dstFormat;
+	victim->flags = flags;
+	victim->colorspace = src->colorspace;
+	victim->fullRange = fullRange;
+	victim->lastUse = de->swsUse;
+	return sws;
+}
+
+static void freeSwsCache(Decoder* de) {
+	int i;
+	for (i = 0; i < SWS_CACHE_SIZE; i++) {
+		if (de->swsCache[i].sws) {
+			sws_freeContext(de->swsCache[i].sws);
+			de->swsCache[i].sws = NULL;
+		}
+	}
+}
+
+// 把解出来的 frameYUV 转成 rgba/bgra
+static Frame* convertRGBA(Decoder* de, int format, const OutputSize* out) {
+	int ret;
+	int width = out->width;
+	int height = out->height;
+	int scaled = width != de->frameYUV->width || height != de->frameYUV->height;
+	int bgra = format == OUTPUT_FORMAT_BGRA;
+	// 创建返回用的对象
+	int size = (width * height) << 2;	// 一个像素4个byte，rgba
+	Frame* f = acquireFrame(de, size);
+	if (!f) {
+		return NULL;
+	}
+	f->width = width;
+	f->height = height;
+	f->format = format;
+	f->planes[0] = f->data;
+	f->strides[0] = width << 2;
+	// 拿到的图片是yuv的，转rgba
+	Yuv2RgbaJob job = { de->frameYUV, f->data, f->strides[0], yuvCoeffsOf(de->frameYUV), bgra };
+	if (!scaled && nativeFormatOf(de->frameYUV->format, &job.nf)) {
+		if (job.nf.depth10) {
+			pthread_once(&g_depth10Once, initDepth10Table);
+			job.scratchStride = FFALIGN(width + ((width + 1) >> 1) * 2, 64);
+			job.scratch = ensureScratch(de, job.scratchStride);
+			if (!job.scratch) {
+				releaseFrame(de, f);
+				return NULL;
+			}
+		}
+		runBands(yuv2rgbaBand, &job, height);
+		return f;
+	}
+	struct SwsContext* sws = getSws(de, de->frameYUV, width, height, bgra ? AV_PIX_FMT_BGRA : AV_PIX_FMT_RGBA, out->swsFlags);
+	if (!sws) {
+		releaseFrame(de, f);
+		return NULL;
+	}
+	
+	uint8_t* dstSlice[AV_NUM_DATA_POINTERS] = {f->data};
+	int dstStride[AV_NUM_DATA_POINTERS] = {width<<2};
+	ret = sws_scale(sws, 
+		(const uint8_t **)(de->frameYUV->data), de->frameYUV->linesize,
+		0, de->frameYUV->height, 
+		dstSlice, dstStride);
+	if (ret < 0) {
+		av_log(NULL, AV_LOG_DEBUG, "sws_scale_frame ret: %d\n", ret);
+		releaseFrame(de, f);
+		return NULL;
+	}
+	return f;
+}
+
+// yuv 输出：yuv420p 直接引用解码器的 AVFrame，不拷贝；其他格式或要缩放时用 sws 转成 yuv420p
+static Frame* convertI420(Decoder* de, const OutputSize* out) {
+	AVFrame* src = de->frameYUV;
+	int width = out->width;
+	int height = out->height;
+	int scaled = width != src->width || height != src->height;
+	int i;
+	if (!scaled && (src->format == AV_PIX_FMT_YUV420P || src->format == AV_PIX_FMT_YUVJ420P)) {
+		Frame* f = acquireFrame(de, 0);
+		if (!f) {
+			return NULL;
+		}
+		if (!f->ref) {
+			f->ref = av_frame_alloc();
+			if (!f->ref) {
+				av_log(NULL, AV_LOG_ERROR, "av_frame_alloc ref fail.");
+				releaseFrame(de, f);
+				return NULL;
+			}
+		}
+		// 只加引用，src 上的时间戳 drainFrames 之后还要用，由它 unref
+		if (av_frame_ref(f->ref, src) < 0) {
+			av_log(NULL, AV_LOG_ERROR, "av_frame_ref fail.");
+			releaseFrame(de, f);
+			return NULL;
+		}
+		for (i = 0; i < 3; i++) {
+			f->planes[i] = f->ref->data[i];
+			f->strides[i] = f->ref->linesize[i];
+		}
+		f->data = f->planes[0];
+		f->width = width;
+		f->height = height;
+		f->format = OUTPUT_FORMAT_I420;
+		return f;
+	}
+
+	int cw = (width + 1) >> 1;
+	int ch = (height + 1) >> 1;
+	Frame* f = acquireFrame(de, width * height + cw * ch * 2);
+	if (!f) {
+		return NULL;
+	}
+	f->width = width;
+	f->height = height;
+	f->format = OUTPUT_FORMAT_I420;
+	f->planes[0] = f->data;
+	f->planes[1] = f->planes[0] + width * height;
+	f->planes[2] = f->planes[1] + cw * ch;
+	f->strides[0] = width;
+	f->strides[1] = cw;
+	f->strides[2] = cw;
+	if (!scaled && src->format == AV_PIX_FMT_YUV420P10LE) {
+		// 10 bit 查表转 8 bit，不走 sws
+		pthread_once(&g_depth10Once, initDepth10Table);
+		int y;
+		for (y = 0; y < height; y++) {
+			depth10To8Row(src->data[0] + y * src->linesize[0], f->planes[0] + y * f->strides[0], width);
+		}
+		for (y = 0; y < ch; y++) {
+			depth10To8Row(src->data[1] + y * src->linesize[1], f->planes[1] + y * f->strides[1], cw);
+			depth10To8Row(src->data[2] + y * src->linesize[2], f->planes[2] + y * f->strides[2], cw);
+		}
+		return f;
+	}
+	struct SwsContext* sws = getSws(de, src, width, height, AV_PIX_FMT_YUV420P, out->swsFlags);
+	if (!sws) {
+		releaseFrame(de, f);
+		return NULL;
+	}
+	uint8_t* dstSlice[AV_NUM_DATA_POINTERS] = {f->planes[0], f->planes[1], f->planes[2]};
+	int dstStride[AV_NUM_DATA_POINTERS] = {f->strides[0], f->strides[1], f->strides[2]};
+	int ret = sws_scale(sws, (const uint8_t **)(src->data), src->linesize, 0, src->height, dstSlice, dstStride);
+	if (ret < 0) {
+		av_log(NULL, AV_LOG_DEBUG, "sws_scale_frame ret: %d\n", ret);
+		releaseFrame(de, f);
+		return NULL;
+	}
+	return f;
+}
+
+// 算出这一帧的输出尺寸，只指定了宽或高的按比例算另一边
+static void outputSizeOf(Decoder* de, const AVFrame* src, OutputSize* out) {
+	int64_t v = __atomic_load_n(&de->outputSize, __ATOMIC_RELAXED);
+	int width = (int)((v >> 32) & 0xFFFF);
+	int height = (int)((v >> 16) & 0xFFFF);
+	int filter = (int)(v & 0xFFFF);
+	if (width <= 0 && height <= 0) {
+		width = src->width;
+		height = src->height;
+	} else if (width <= 0) {
+		width = (int)((int64_t)src->width * height / src->height);
+	} else if (height <= 0) {
+		height = (int)((int64_t)src->height * width / src->width);
+	}
+	out->width = width > 0 ? width : 1;
+	out->height = height > 0 ? height : 1;
+	switch (filter) {
+		case SCALE_FILTER_BILINEAR:
+			out->swsFlags = SWS_BILINEAR;
+			break;
+		case SCALE_FILTER_AREA:
+			out->swsFlags = SWS_AREA;
+			break;
+		default:
+			out->swsFlags = SWS_FAST_BILINEAR;
+			break;
+	}
+	if (out->width == src->width && out->height == src->height) {
+		// 不缩放，sws 只转格式，flags 不影响结果，统一一个省得多建 sws
+		out->swsFlags = 0;
+	}
+}
+
+// 把解出来的 frameYUV 转成要输出的格式
+Frame* convertFrame(Decoder* de) {
+	int format = __atomic_load_n(&de->outputFormat, __ATOMIC_RELAXED);
+	OutputSize out;
+	outputSizeOf(de, de->frameYUV, &out);
+	if (format == OUTPUT_FORMAT_I420) {
+		return convertI420(de, &out);
+	}
+	return convertRGBA(de, format, &out);
+}
+
+// 设置输出尺寸，转格式时直接缩放到这个尺寸，可以随时调用，从下一帧开始生效
+// width/height 都 <=0 表示原尺寸，只给一边时按比例算另一边，filter 是 SCALE_FILTER_*
+int setOutputSize(void *ctx, int width, int height, int filter) {
+	if (!ctx) {
+		return -1;
+	}
+	Decoder* de = (Decoder*)ctx;
+	if (width > 0xFFFF || height > 0xFFFF) {
+		return -1;
+	}
+	if (width < 0) {
+		width = 0;
+	}
+	if (height < 0) {
+		height = 0;
+	}
+	int64_t v = ((int64_t)width << 32) | ((int64_t)height << 16) | (filter & 0xFFFF);
+	__atomic_store_n(&de->outputSize, v, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// 设置输出格式 OUTPUT_FORMAT_*，可以随时调用，从下一帧开始生效
+int setOutputFormat(void *ctx, int format) {
+	if (!ctx) {
+		return -1;
+	}
+	Decoder* de = (Decoder*)ctx;
+	if (format != OUTPUT_FORMAT_RGBA && format != OUTPUT_FORMAT_I420 && format != OUTPUT_FORMAT_BGRA) {
+		return -1;
+	}
+	__atomic_store_n(&de->outputFormat, format, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// ==== 解码线程池，所有解码器共用 ====
+// 解码器不再各自占一个线程，有数据要处理的解码器由池里的线程轮流处理，空闲的解码器不占线程
+#define DECODE_MAX_THREADS	8
+#define DECODE_BATCH		8	// 一次最多连续处理一个解码器的几块数据，让其他解码器也轮得到
+
+#define DEFAULT_DEADLINE	100		// 默认的截止时间(ms)
+#define SCHED_WINDOW		1000	// 统计 cpu 占用和错过截止时间的周期(ms)
+
+typedef struct {
+	pthread_mutex_t mutex;
+	Decoder **decoders;		// 所有解码器
+	int count;
+	int capacity;
+	int topPriority;		// 有数据要解的解码器里最高的优先级
+	int bottomPriority;		// 有数据要解的解码器里最低的优先级
+	int readyCount;			// 有数据要解的解码器个数，和上面两个都是最近一次 claimDecoder 时的
+	int threads;			// 已启动的线程数
+	volatile int wakeSeq;	// 唤醒池里线程用的 futex，有新数据、输出队列腾出空位时加一
+} DecodePool;
+
+static DecodePool g_decodePool = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0, 0 };
+
+// 解码器有活要干了(新数据、输出队列腾出空位、要结束)，叫醒池里一个空闲的线程来找
+// 解码线程从不为某个解码器等，只在池的 wakeSeq 上等
+static void wakeDecodePool(void) {
+	__atomic_add_fetch(&g_decodePool.wakeSeq, 1, __ATOMIC_SEQ_CST);
+	emscripten_futex_wake(&g_decodePool.wakeSeq, 1);
+}
+
+// 取出队头，要持有 frameMutex
+static Frame* popFrameLocked(Decoder* de) {
+	if (de->frameCount <= 0) {
+		return NULL;
+	}
+	Frame *f = de->frameQueue[de->frameStart];
+	de->frameQueue[de->frameStart] = NULL;
+	de->frameStart = (de->frameStart + 1) % de->frameDepth;
+	de->frameCount--;
+	return f;
+}
+
+// 一帧被取走了，记统计
+static void frameDelivered(Decoder* de, Frame* f, double now) {
+	STATS_ADD(de, framesDelivered, 1);
+	statsRecord(&de->stats, STATS_HIST_QUEUE_WAIT, now - f->queuedAt);
+	if (f->inputTime > 0) {
+		statsRecord(&de->stats, STATS_HIST_PUT_TO_GET, now - f->inputTime);
+	}
+}
+
+// 阻塞模式下输出队列满了，要等 getFrame 取走才能再出帧
+// 不持锁，读到的可能是旧的；解码线程里放帧的只有自己，读到不满就一定有位置
+static int frameQueueFull(Decoder* de) {
+	return de->framePolicy == FRAME_POLICY_BLOCK && __atomic_load_n(&de->frameCount, __ATOMIC_RELAXED) >= de->frameDepth;
+}
+
+// 在转格式之前给新的一帧腾出位置，丢帧模式下丢掉最老的，阻塞模式下调用前已经用 frameQueueFull 看过了
+// 被丢的是队列里已经转好格式的帧，新解出来的帧总是要转的，丢帧省下的只是队列的内存，转格式的时间省不了
+static void makeFrameSlot(Decoder* de) {
+	pthread_mutex_lock(&de->frameMutex);
+	while (de->frameCount >= de->frameDepth && de->framePolicy != FRAME_POLICY_BLOCK) {
+		Frame *old = popFrameLocked(de);
+		av_log(NULL, AV_LOG_DEBUG, "frame queue full, drop %p\n", old);
+		releaseFrame(de, old);
+		STATS_ADD(de, framesDropped, 1);
+	}
+	pthread_mutex_unlock(&de->frameMutex);
+}
+
+// 操作frame的队列
+int putFrame(void *ctx, Frame* frame) {
+	if (!ctx) {
+		return -1;
+	}
+	Decoder* de = (Decoder*)ctx;
+
+	Frame *dropped = NULL;
+	frame->queuedAt = emscripten_get_now();
+	pthread_mutex_lock(&de->frameMutex);
+	if (de->frameCount >= de->frameDepth) {
+		// 转格式期间队列被改小了
+		dropped = popFrameLocked(de);
+	}
+	de->frameQueue[(de->frameStart + de->frameCount) % de->frameDepth] = frame;
+	de->frameCount++;
+	pthread_mutex_unlock(&de->frameMutex);
+	if (dropped) {
+		releaseFrame(de, dropped);
+		STATS_ADD(de, framesDropped, 1);
+	}
+	return 0;
+}
+
+Frame* getFrame(void *ctx) {
+	if (!ctx) {
+		return NULL;
+	}
+	Decoder* de = (Decoder*)ctx;
+
+	pthread_mutex_lock(&de->frameMutex);
+	int full = de->frameCount >= de->frameDepth;
+	Frame *ret = popFrameLocked(de);
+	pthread_mutex_unlock(&de->frameMutex);
+	if (ret) {
+		frameDelivered(de, ret, emscripten_get_now());
+	}
+	if (ret && full && de->framePolicy == FRAME_POLICY_BLOCK) {
+		// 腾出了空位，留在解码器里的帧可以接着出了
+		wakeDecodePool();
+	}
+	return ret;
+}
+
+// 一次取出最多 max 帧放到 frames 里，返回取到的帧数，只加一次锁
+// js 直接按 Frame 的结构读每一帧，用完后用 releaseFrames 一起还回去
+int getFrames(void *ctx, Frame** frames, int max) {
+	if (!ctx || !frames) {
+		return 0;
+	}
+	Decoder* de = (Decoder*)ctx;
+
+	int n = 0;
+	pthread_mutex_lock(&de->frameMutex);
+	int full = de->frameCount >= de->frameDepth;
+	while (n < max) {
+		Frame *f = popFrameLocked(de);
+		if (!f) {
+			break;
+		}
+		frames[n++] = f;
+	}
+	pthread_mutex_unlock(&de->frameMutex);
+	double now = emscripten_get_now();
+	for (int i = 0; i < n; i++) {
+		frameDelivered(de, frames[i], now);
+	}
+	if (n > 0 && full && de->framePolicy == FRAME_POLICY_BLOCK) {
+		// 腾出了空位，留在解码器里的帧可以接着出了
+		wakeDecodePool();
+	}
+	return n;
+}
+
+// 设置输出队列的长度和满了之后的处理方式，可以随时调用
+// depth <= 0 时用默认长度，FRAME_POLICY_LATEST 时长度固定为 1
+int setFrameQueue(void *ctx, int depth, int policy) {
+	if (!ctx) {
+		return -1;
+	}
+	Decoder* de = (Decoder*)ctx;
+	if (policy != FRAME_POLICY_DROP_OLDEST && policy != FRAME_POLICY_LATEST) {
+		policy = FRAME_POLICY_BLOCK;
+	}
+	if (depth <= 0) {
+		depth = DEFAULT_FRAME_QUEUE_DEPTH;
+	}
+	if (policy == FRAME_POLICY_LATEST) {
+		depth = 1;
+	}
+	Frame **queue = malloc(sizeof(Frame*) * depth);
+	if (!queue) {
+		av_log(NULL, AV_LOG_ERROR, "malloc err in setFrameQueue\n");
+		return -1;
+	}
+	memset(queue, 0, sizeof(Frame*) * depth);
+
+	pthread_mutex_lock(&de->frameMutex);
+	// 放不下的旧帧丢掉，保留最新的
+	while (de->frameCount > depth) {
+		releaseFrame(de, popFrameLocked(de));
+		STATS_ADD(de, framesDropped, 1);
+	}
+	int count = 0;
+	Frame *f = NULL;
+	while ((f = popFrameLocked(de)) != NULL) {
+		queue[count++] = f;
+	}
+	free(de->frameQueue);
+	de->frameQueue = queue;
+	de->frameDepth = depth;
+	de->frameStart = 0;
+	de->frameCount = count;
+	de->framePolicy = policy;
+	pthread_mutex_unlock(&de->frameMutex);
+	// 队列变长了，留在解码器里的帧可以接着出了
+	wakeDecodePool();
+	return 0;
+}
+
+// 输入新的数据，buf 由 js 用 malloc 分配，后面要留 AV_INPUT_BUFFER_PADDING_SIZE 个 0，
+// 解码线程直接在上面 parse，用完后 free
+// flags: BUFFER_FLAG_*
+// pts/dts: 这段数据里开始的那一帧的时间戳(ms)，NaN 表示没有，parser 和解码器会把它带到对应的帧上
+int putBuffer(void *ctx, unsigned char *buf, int len, int flags, double pts, double dts) {
+	av_log(NULL, AV_LOG_DEBUG, "putBuffer %d\n", len);
+	if (!ctx) {
+		return -1;
+	}
+	Decoder* de = (Decoder*)ctx;
+	BufferList *item = malloc(sizeof(BufferList));
+	if (!item) {
+		av_log(NULL, AV_LOG_ERROR, "malloc err in putBuffer\n");
+		return -1;
+	}
+	pthread_mutex_lock(&de->bufferMutex);
+	item->next = NULL;
+	item->buf = buf;
+	item->len = len;
+	item->flags = flags;
+	item->pts = msToTs(pts);
+	item->dts = msToTs(dts);
+	item->putTime = emscripten_get_now();
+	if (de->bufferTail == NULL) {
+		// 空链
+		de->bufferHead = item;
+		de->bufferTail = item;
+	} else {
+		de->bufferTail->next = item;
+		de->bufferTail = item;
+	}
+	pthread_mutex_unlock(&de->bufferMutex);
+	__atomic_add_fetch(&de->bufferBytes, len, __ATOMIC_RELAXED);
+	wakeDecodePool();
+	return 0;
+}
+
+// 直接输入一个完整的包(AU)，不经过 parser。buf 和 putBuffer 一样由 js 用 malloc 分配并补 0，
+// 解码器直接引用这块内存，不再拷贝，解码器用完时 free
+// flags: BUFFER_FLAG_KEY_FRAME
+int putPacket(void *ctx, unsigned char *buf, int len, int flags, double pts, double dts) {
+	return putBuffer(ctx, buf, len, (flags & BUFFER_FLAG_KEY_FRAME) | BUFFER_FLAG_PACKET, pts, dts);
+}
+
+// 每解出一帧更新延迟统计
+static void updateDecodeStats(Decoder* de, const AVFrame* frame) {
+	DecoderStats* st = &de->stats;
+	double latency = emscripten_get_now() - frame->reordered_opaque / 1000.0;
+	st->decodeLatency = latency;
+	st->avgDecodeLatency = st->avgDecodeLatency > 0 ? st->avgDecodeLatency * 0.9 + latency * 0.1 : latency;
+	st->reorderDelay = de->ctx->has_b_frames;
+	st->threadDelay = (de->ctx->active_thread_type & FF_THREAD_FRAME) ? de->ctx->thread_count - 1 : 0;
+}
+
+// 取统计信息，js 按 DecoderStats 的结构读
+DecoderStats* getStats(void *ctx) {
+	if (!ctx) {
+		return NULL;
+	}
+	Decoder* de = (Decoder*)ctx;
+	// 队列长度在取的时候算，解码线程不用一直更新
+	InputRing* r = __atomic_load_n(&de->ring, __ATOMIC_ACQUIRE);
+	de->stats.inputQueue = r ? __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)
+		: __atomic_load_n(&de->bufferBytes, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&de->frameMutex);
+	de->stats.frameQueue = de->frameCount;
+	pthread_mutex_unlock(&de->frameMutex);
+	return &de->stats;
+}
+
+// 输出帧的时间戳和时长
+static void setFrameTiming(Decoder* de, Frame* f, const AVFrame* frame) {
+	// best_effort_timestamp 在只有 dts 的时候也能推出来
+	int64_t pts = frame->best_effort_timestamp;
+	f->pts = pts == AV_NOPTS_VALUE ? NAN : (double)pts / TIME_PER_MS;
+	// parser/解码器会按 SPS VUI 的 timing_info 设置 framerate
+	AVRational fr = de->ctx->framerate;
+	f->duration = fr.num > 0 && fr.den > 0 ? (1000.0 * fr.den / fr.num) * (1 + frame->repeat_pict * 0.5) : 0;
+	// 包的 pos 里放的是数据进解码器的时间(us)，解码器会带到对应的帧上
+	f->inputTime = frame->pkt_pos > 0 ? frame->pkt_pos / 1000.0 : 0;
+}
+
+static void freeDecoder(Decoder* de);
+
+// 在主线程执行：把队列里的帧都交给回调
+static void deliverFrames(Decoder* de) {
+	// 先清标记再取，取的过程中新进来的帧会再发一次通知
+	__atomic_store_n(&de->notifyPending, 0, __ATOMIC_SEQ_CST);
+	if (de->zombie) {
+		freeDecoder(de);
+		return;
+	}
+	Frame *f = NULL;
+	de->delivering = 1;
+	if (de->frameCbMode == FRAME_CB_NOTIFY) {
+		// 帧留在队列里，js 按自己的节奏用 getFrame/getFrames 取
+		if (de->frameCb) {
+			de->frameCb(de->frameCbOpaque, NULL);
+		}
+	} else {
+		while (!de->zombie && de->frameCb && (f = getFrame(de)) != NULL) {
+			de->frameCb(de->frameCbOpaque, f);
+			releaseFrame(de, f);
+		}
+	}
+	de->delivering = 0;
+	if (de->zombie && !de->notifyPending) {
+		// 回调里调用了 releaseDecoder
+		freeDecoder(de);
+	}
+}
+
+// 有新帧进了队列(或者 flush 完了)，通知主线程，已经有通知没执行的就不再发
+static void notifyFrame(Decoder* de) {
+	if (!de->frameCb) {
+		return;
+	}
+	int expected = 0;
+	if (__atomic_compare_exchange_n(&de->notifyPending, &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		emscripten_async_run_in_main_runtime_thread(EM_FUNC_SIG_VI, deliverFrames, de);
+	}
+}
+
+// 设置有新帧时的回调，要在输入数据之前设置，cb 为 NULL 时取消，mode 是 FRAME_CB_*
+int setFrameCallback(void *ctx, FrameCallback cb, void *opaque, int mode) {
+	if (!ctx) {
+		return -1;
+	}
+	Decoder* de = (Decoder*)ctx;
+	de->frameCbOpaque = opaque;
+	de->frameCbMode = mode;
+	__atomic_store_n(&de->frameCb, cb, __ATOMIC_RELEASE);
+	return 0;
+}
+
+#define OUTPUT_FULL	1	// drainFrames 的返回值：阻塞模式下输出队列满了，剩下的帧留在解码器里
+
+// 队列只留一帧的丢帧模式下，解码器里紧跟着已经有下一帧(flush、追帧时)，这一帧转了也马上被顶掉，直接跳过
+// 要丢的帧已经进了队列、转好了格式的省不了，见 makeFrameSlot
+static void skipSupersededFrames(Decoder* de) {
+	if (de->framePolicy == FRAME_POLICY_BLOCK || de->frameDepth != 1) {
+		return;
+	}
+	while (avcodec_receive_frame(de->ctx, de->frameNext) >= 0) {
+		STATS_ADD(de, framesDecoded, 1);
+		STATS_ADD(de, framesDropped, 1);
+		av_frame_unref(de->frameYUV);
+		av_frame_move_ref(de->frameYUV, de->frameNext);
+		updateDecodeStats(de, de->frameYUV);
+	}
+}
+
+// 取出所有解好的帧
+// 阻塞模式下输出队列满了就不取了，返回 OUTPUT_FULL，不在解码线程里等，getFrame 取走帧后由 pumpDecoder 接着取
+static int drainFrames(Decoder* de) {
+	while (1) {
+		if (frameQueueFull(de)) {
+			de->outputPending = 1;
+			return OUTPUT_FULL;
+		}
+		int ret = avcodec_receive_frame(de->ctx, de->frameYUV);
+		if (ret < 0) {
+			av_log(NULL, AV_LOG_DEBUG, "avcodec_receive_frame ret: %d\n", ret);
+			break;
+		}
+		av_log(NULL, AV_LOG_DEBUG, "got frame\n");
+		STATS_ADD(de, framesDecoded, 1);
+		updateDecodeStats(de, de->frameYUV);
+		skipSupersededFrames(de);
+		makeFrameSlot(de);
+		double start = emscripten_get_now();
+		Frame *f = convertFrame(de);
+		if (f) {
+			statsRecord(&de->stats, STATS_HIST_CONVERT, emscripten_get_now() - start);
+			STATS_ADD(de, framesConverted, 1);
+			setFrameTiming(de, f, de->frameYUV);
+		}
+		av_frame_unref(de->frameYUV);
+		if (f) {
+			putFrame(de, f);
+			if (de->stats.timeToFirstFrame == 0) {
+				de->stats.timeToFirstFrame = emscripten_get_now() - de->stats.firstInputTime;
+			}
+			notifyFrame(de);
+		}
+	}
+	de->outputPending = 0;
+	return 0;
+}
+
+// skipMode 打包/解包，AVDISCARD_NONE 是负数，按有符号字节存
+#define SKIP_MODE_PACK(frame, loopFilter, idct) \
+	(((frame) & 0xFF) | (((loopFilter) & 0xFF) << 8) | (((idct) & 0xFF) << 16))
+#define SKIP_MODE_FRAME(v)			((int8_t)((v) & 0xFF))
+#define SKIP_MODE_LOOP_FILTER(v)	((int8_t)(((v) >> 8) & 0xFF))
+#define SKIP_MODE_IDCT(v)			((int8_t)(((v) >> 16) & 0xFF))
+
+// 调度器自动降级的丢帧等级，过载时后台的解码器一级一级降，空闲了再一级一级升回来
+#define AUTO_SKIP_NONE		0
+#define AUTO_SKIP_NONREF	1	// 不解非参考帧
+#define AUTO_SKIP_KEYFRAME	2	// 只解关键帧
+#define AUTO_SKIP_MAX		AUTO_SKIP_KEYFRAME
+
+static const int kAutoSkipModes[AUTO_SKIP_MAX + 1] = {
+	SKIP_MODE_PACK(AVDISCARD_DEFAULT, AVDISCARD_DEFAULT, AVDISCARD_DEFAULT),
+	SKIP_MODE_PACK(AVDISCARD_NONREF, AVDISCARD_NONREF, AVDISCARD_DEFAULT),
+	SKIP_MODE_PACK(AVDISCARD_NONKEY, AVDISCARD_NONREF, AVDISCARD_DEFAULT),
 };
 
-// 链表，用来存结果frame
-typedef struct _FrameList FrameList;
-struct _FrameList
-{
-	FrameList *next;
-	Frame *frame;
-};
+// 两个丢帧模式每一项取丢得多的
+static int mergeSkipMode(int a, int b) {
+	return SKIP_MODE_PACK(FFMAX(SKIP_MODE_FRAME(a), SKIP_MODE_FRAME(b)), 
+		FFMAX(SKIP_MODE_LOOP_FILTER(a), SKIP_MODE_LOOP_FILTER(b)), 
+		FFMAX(SKIP_MODE_IDCT(a), SKIP_MODE_IDCT(b)));
+}
+
+// 把 setSkipMode 设置的丢帧模式和调度器的自动降级合起来应用到解码器上，只在解码线程里调用，pkt 是马上要送的包
+// 收紧立刻生效；放宽要等关键帧，GOP 中间放宽的话后面的帧会参考之前没解的帧，一直花到下一个关键帧
+// 包上从来没有关键帧标记的(putPacket 没给 keyFrame)等不到，立刻放宽
+static void applySkipMode(Decoder* de, const AVPacket* pkt) {
+	int key = pkt && (pkt->flags & AV_PKT_FLAG_KEY);
+	if (key) {
+		de->keyFlagSeen = 1;
+	}
+	int v = mergeSkipMode(__atomic_load_n(&de->skipMode, __ATOMIC_RELAXED), kAutoSkipModes[de->autoSkip]);
+	if (!key && de->keyFlagSeen) {
+		v = mergeSkipMode(v, de->appliedSkipMode);
+	}
+	if (v == de->appliedSkipMode) {
+		return;
+	}
+	de->ctx->skip_frame = SKIP_MODE_FRAME(v);
+	de->ctx->skip_loop_filter = SKIP_MODE_LOOP_FILTER(v);
+	de->ctx->skip_idct = SKIP_MODE_IDCT(v);
+	de->appliedSkipMode = v;
+	av_log(NULL, AV_LOG_DEBUG, "applySkipMode frame: %d, loop_filter: %d, idct: %d\n", 
+		de->ctx->skip_frame, de->ctx->skip_loop_filter, de->ctx->skip_idct);
+}
+
+// 设置丢帧模式，三个参数都是 AVDISCARD_* 的值，可以随时调用，从下一个包开始生效
+// 例如只解关键帧：skipFrame = AVDISCARD_NONKEY；不解非参考帧：skipFrame = AVDISCARD_NONREF
+int setSkipMode(void *ctx, int skipFrame, int skipLoopFilter, int skipIdct) {
+	if (!ctx) {
+		return -1;
+	}
+	Decoder* de = (Decoder*)ctx;
+	__atomic_store_n(&de->skipMode, SKIP_MODE_PACK(skipFrame, skipLoopFilter, skipIdct), __ATOMIC_RELAXED);
+	return 0;
+}
+
+// 送一个包去解码，解码器满了(EAGAIN)就先把帧取走再送
+// 阻塞模式下输出队列也满了时包送不进去，拷到 heldPacket 里留着(held)，返回 AVERROR(EAGAIN)，由 pumpDecoder 重送
+static int sendPacket(Decoder* de, AVPacket* pkt) {
+	applySkipMode(de, pkt);
+	// 送进去的时间(us)，解码器会按帧重排序后带到 AVFrame.reordered_opaque 上
+	double start = emscripten_get_now();
+	de->ctx->reordered_opaque = (int64_t)(start * 1000);
+	int ret = avcodec_send_packet(de->ctx, pkt);
+	double used = emscripten_get_now() - start;
+	if (ret == AVERROR(EAGAIN) && drainFrames(de) != OUTPUT_FULL) {
+		start = emscripten_get_now();
+		ret = avcodec_send_packet(de->ctx, pkt);
+		used += emscripten_get_now() - start;
+	}
+	if (ret == AVERROR(EAGAIN)) {
+		// 送空包的由 drainState 记着，不用留
+		if (pkt && pkt != de->heldPacket) {
+			// parser 出的包和环里的数据不是引用计数的，这里会拷贝一份
+			if (av_packet_ref(de->heldPacket, pkt) < 0) {
+				av_log(NULL, AV_LOG_ERROR, "av_packet_ref err in sendPacket\n");
+				return ret;
+			}
+		}
+		de->held = pkt != NULL;
+		return ret;
+	}
+	if (pkt == de->heldPacket) {
+		av_packet_unref(de->heldPacket);
+		de->held = 0;
+	}
+	if (pkt) {
+		STATS_ADD(de, packets, 1);
+		statsRecord(&de->stats, STATS_HIST_DECODE, used);
+	}
+	av_log(NULL, AV_LOG_DEBUG, "decodeThreadFun avcodec_send_packet ret %d.\n", ret);
+	if (ret < 0) {
+		av_log(NULL, AV_LOG_VERBOSE, "avcodec_send_packet ret: %d\n", ret);
+	}
+	drainFrames(de);
+	return ret;
+}
+
+// 送 parser 分出来的包，时间戳 parser 没有放在包里，要自己取
+static void sendParsedPacket(Decoder* de) {
+	de->packet->pts = de->parser->pts;
+	de->packet->dts = de->parser->dts;
+	// IDR/IRAP，放宽丢帧模式要等它
+	de->packet->flags = de->parser->key_frame == 1 ? AV_PKT_FLAG_KEY : 0;
+	// 包是在这块数据里结束的，按这块数据进来的时间算
+	de->packet->pos = (int64_t)(de->chunkTime * 1000);
+	sendPacket(de, de->packet);
+}
+
+// parse 一段数据，分出来的包送去解码
+// pts/dts 是这段数据的时间戳，parser 会把它带到从这段数据里开始的包上
+// complete: 这段数据正好是完整的 AU，parser 不找帧边界，整段作为一个包立刻送去解码，还是会解析 SPS/PPS
+// 返回用掉的字节数，包没送进去(held)时停下，剩下的下次接着 parse；出错时剩下的不要了，也算用掉
+static int parseData(Decoder* de, uint8_t* buf, int n, int64_t pts, int64_t dts, int complete) {
+	int total = n;
+	if (!de->parser) {
+		return total;
+	}
+	if (complete) {
+		de->parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+	} else if (n > 0) {
+		// 最后一个 AU 会攒在 parser 里等下一个起始码
+		de->parserAligned = 0;
+	}
+	while (n > 0 && de->parser) {
+		double start = emscripten_get_now();
+		int ret = av_parser_parse2(de->parser, de->ctx, &(de->packet->data), &(de->packet->size), 
+			buf, n, pts, dts, 0);
+		statsRecord(&de->stats, STATS_HIST_PARSE, emscripten_get_now() - start);
+		// 同一段数据的时间戳只给一次，剩下的部分再给会被当成新的包的
+		pts = dts = AV_NOPTS_VALUE;
+		av_log(NULL, AV_LOG_DEBUG, "decodeThreadFun av_parser_parse2 ret %d.\n", ret);
+		if (ret < 0) {
+			av_log(NULL, AV_LOG_VERBOSE, "av_parser_parse2 ret %d\n", ret);
+			break;
+		}
+		buf += ret;
+		n -= ret;
+		if (de->packet->size > 0) {
+			sendParsedPacket(de);
+			if (de->held) {
+				break;
+			}
+		}
+	}
+	if (complete && de->parser) {
+		de->parser->flags &= ~PARSER_FLAG_COMPLETE_FRAMES;
+	}
+	return de->held ? total - n : total;
+}
+
+// 让 parser 把攒着的数据立刻作为一个包吐出来，不用等下一个起始码
+// 之后要重建 parser，会丢掉它解析过的 SPS/PPS，所以只在流结束，或者以 AU 结尾的数据前面还有没对齐的数据时用
+static void flushParser(Decoder* de) {
+	if (!de->parser) {
+		return;
+	}
+	int ret = av_parser_parse2(de->parser, de->ctx, &(de->packet->data), &(de->packet->size), 
+		NULL, 0, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+	if (ret >= 0 && de->packet->size > 0) {
+		sendParsedPacket(de);
+	}
+	// 送过空数据后 parser 认为流结束了，重建一个，下一段数据从新的 AU 开始找
+	av_parser_close(de->parser);
+	de->parser = av_parser_init(de->codec->id);
+	if (!de->parser) {
+		av_log(NULL, AV_LOG_ERROR, "av_parser_init fail in flushParser.\n");
+	}
+}
+
+#define DRAIN_NONE		0
+#define DRAIN_SEND		1	// 要送空包
+#define DRAIN_RECEIVE	2	// 空包送过了，在取剩下的帧
 
-typedef struct {
-	IOReadCallback io_read_cb;	// 读数据的回调
-	AVIOContext* io_ctx;	// avio
-	size_t io_buffer_size;	// 缓存(avio用的)大小
-	uint8_t* io_buffer;		// 缓存(avio用的)
-	AVInputFormat* input_format;	// 封装格式
-	AVFormatContext* fmt; 	// 流封装
-	AVCodecParserContext* parser;	// 相当于fmt
-	AVCodec* codec;			// 编码
-	int stream_index;		// 视频流的序号
-	AVCodecContext* ctx;	// 解码句柄
-	AVPacket* packet;		// 数据帧
-	AVFrame* frameYUV;		// 解出的图片帧
-	AVFrame* frameRGBA;		// 解出的图片帧
-	struct SwsContext* sws;	// 转格式
-	int width;				// 图像宽度
-	int height;				// 图像高度
-	int found_info;			// 找到流信息
-	int offset;				// 已经处理过的数据
-	Frame* latestFrame;	// 最新的一帧解码结果
-	pthread_t decodeThread;	// 线程
-	pthread_mutex_t bufferMutex;
-	pthread_mutex_t frameMutex;
-	BufferList *bufferHead;
-	BufferList *bufferTail;
-	FrameList *frameHead;
-	FrameList *frameTail;
-	int needStop; // 要结束 
-} Decoder;
+// 流结束：送空包让解码器把因为重排序和多线程攒着的帧都吐出来，再重置解码器，可以接着解下一段流
+// 阻塞模式下输出队列满了时做不完，返回 0，drainState 记着做到哪一步，下次接着做
+static int drainDecoder(Decoder* de) {
+	if (de->drainState == DRAIN_SEND) {
+		if (sendPacket(de, NULL) == AVERROR(EAGAIN)) {
+			return 0;
+		}
+		de->drainState = DRAIN_RECEIVE;
+	}
+	if (drainFrames(de) == OUTPUT_FULL) {
+		return 0;
+	}
+	avcodec_flush_buffers(de->ctx);
+	de->drainState = DRAIN_NONE;
+	// 下一段流重新算首帧时间
+	de->stats.firstInputTime = 0;
+	de->stats.timeToFirstFrame = 0;
+	__atomic_add_fetch(&de->stats.flushCount, 1, __ATOMIC_RELEASE);
+	// 用回调的不用轮询 flushing()，flush 完了也通知一次，可能没有新帧
+	notifyFrame(de);
+	return 1;
+}
 
-Frame* recvFrame(Decoder* de) {
-	int ret = avcodec_receive_frame(de->ctx, de->frameYUV);
-	if (ret < 0) {
-		av_log(NULL, AV_LOG_DEBUG, "avcodec_receive_frame ret: %d\n", ret);
-		return NULL;
+// 一段带 flags 的数据处理完了
+// parser 对齐时以 AU 结尾的数据已经按完整的 AU 整段送出去了，不用再冲 parser
+// 前面的包还没送进去(held)时先记下，送进去之后再处理，保证顺序
+static void endOfChunk(Decoder* de, int flags) {
+	if (de->held) {
+		de->pendingFlags |= flags;
+		return;
 	}
-	int width = de->frameYUV->width;
-	int height = de->frameYUV->height;
-	// 创建返回用的对象
-	int size = (width * height) << 2;	// 一个像素4个byte，rgba
-	Frame* f = malloc(sizeof(Frame) + size);
-	if (!f) {
-		av_log(NULL, AV_LOG_ERROR, "av_malloc err: %d\n", size);
-		return NULL;
+	if ((flags & BUFFER_FLAG_FLUSH) || ((flags & BUFFER_FLAG_END_OF_AU) && !de->parserAligned)) {
+		flushParser(de);
+		de->parserAligned = 1;
 	}
-	f->width = width;
-	f->height = height;
-	// 拿到的图片是yuv的，转rgba
-	if (de->sws) {
-		if (de->width != width || de->height != height) {
-			sws_freeContext(de->sws);
-			de->sws = NULL;
-		}
-	}
-	if (!de->sws) {
-		de->sws = sws_getContext(
-			width, height, AV_PIX_FMT_YUV420P,
-			width, height, AV_PIX_FMT_RGBA,
-			0, NULL, NULL, NULL);
-		if (!de->sws) {
-			av_log(NULL, AV_LOG_ERROR, "sws_getContext fail.");
-			return NULL;
+	if (flags & BUFFER_FLAG_FLUSH) {
+		de->drainState = DRAIN_SEND;
+		if (!de->held) {
+			drainDecoder(de);
 		}
-		de->width = width;
-		de->height = height;
 	}
-	
-	uint8_t* dstSlice[AV_NUM_DATA_POINTERS] = {f->buf};
-	int dstStride[AV_NUM_DATA_POINTERS] = {width<<2};
-	// av_log(NULL, AV_LOG_ERROR, "dstSlice: %p, %p, %p, %p, %p, %p, %p, %p\n", dstSlice[0], dstSlice[1], dstSlice[2], dstSlice[3], dstSlice[4], dstSlice[5], dstSlice[6], dstSlice[7]);
-	// av_log(NULL, AV_LOG_ERROR, "dstStride: %d, %d, %d, %d, %d, %d, %d, %d\n", dstStride[0], dstStride[1], dstStride[2], dstStride[3], dstStride[4], dstStride[5], dstStride[6], dstStride[7]);
-	// av_log(NULL, AV_LOG_ERROR, "srcSlice: %p, %p, %p, %p, %p, %p, %p, %p\n", de->frameYUV->data[0], de->frameYUV->data[1], de->frameYUV->data[2], de->frameYUV->data[3], de->frameYUV->data[4], de->frameYUV->data[5], de->frameYUV->data[6], de->frameYUV->data[7]);
-	// av_log(NULL, AV_LOG_ERROR, "srcStride: %d, %d, %d, %d, %d, %d, %d, %d\n", de->frameYUV->linesize[0], de->frameYUV->linesize[1], de->frameYUV->linesize[2], de->frameYUV->linesize[3], de->frameYUV->linesize[4], de->frameYUV->linesize[5], de->frameYUV->linesize[6], de->frameYUV->linesize[7]);
-	ret = sws_scale(de->sws, 
-		(const uint8_t **)(de->frameYUV->data), de->frameYUV->linesize,
-		0, height, 
-		dstSlice, dstStride);
-	// av_log(NULL, AV_LOG_ERROR, "sws_scale end\n");
-	if (ret < 0) {
-		av_log(NULL, AV_LOG_DEBUG, "sws_scale_frame ret: %d\n", ret);
-		return NULL;
+}
+
+// 接着做上次因为阻塞模式下输出队列满了没做完的：重送留下的包、推迟的 flags、流结束的 drain、解码器里剩下的帧
+// 返回 0 表示还是没做完，这时不能读新的输入
+static int pumpDecoder(Decoder* de) {
+	if (de->held) {
+		sendPacket(de, de->heldPacket);
+		if (de->held) {
+			return 0;
+		}
 	}
-	av_frame_unref(de->frameYUV);
-	return f;
+	if (de->pendingFlags) {
+		int flags = de->pendingFlags;
+		de->pendingFlags = 0;
+		endOfChunk(de, flags);
+		if (de->held) {
+			return 0;
+		}
+	}
+	if (de->drainState != DRAIN_NONE && !drainDecoder(de)) {
+		return 0;
+	}
+	if (de->outputPending && drainFrames(de) == OUTPUT_FULL) {
+		return 0;
+	}
+	return 1;
 }
 
-// 操作frame的list
-int putFrame(void *ctx, Frame* frame) {
-	if (!ctx) {
-		return -1;
+// 送一个调用方给的完整的包，buf 不为 NULL 时包直接引用这块内存
+static void sendInputPacket(Decoder* de, AVBufferRef* buf, uint8_t* data, int len, int flags, int64_t pts, int64_t dts) {
+	AVPacket* pkt = de->packet;
+	pkt->buf = buf;
+	pkt->data = data;
+	pkt->size = len;
+	pkt->pts = pts;
+	pkt->dts = dts;
+	pkt->flags = (flags & BUFFER_FLAG_KEY_FRAME) ? AV_PKT_FLAG_KEY : 0;
+	pkt->pos = (int64_t)(de->chunkTime * 1000);
+	sendPacket(de, pkt);
+	// parser 也用这个包，送完清掉
+	av_packet_unref(pkt);
+}
+
+static void freeInputBuffer(void *opaque, uint8_t *data) {
+	free(data);	// 这个内存是js里面分配的
+}
+
+// 标记的这段数据要不要等整段都写进来再一次处理：完整的包，或者 parser 对齐时以 AU 结尾的一段(整段就是完整的 AU)
+// 比环还大的写不完整，只能边写边 parse
+static int ringWholeChunk(Decoder* de, InputRing* r, RingMark* m) {
+	if (m->flags & BUFFER_FLAG_PACKET) {
+		return 1;
 	}
-	Decoder* de = (Decoder*)ctx;
+	return (m->flags & BUFFER_FLAG_END_OF_AU) && de->parserAligned && m->end - m->start <= r->size;
+}
 
-	FrameList *item = malloc(sizeof(FrameList));
-	if (!item) {
-		av_log(NULL, AV_LOG_ERROR, "malloc err in putFrame\n");
-		return -1;
+// 环里要整段处理的一段数据(见 ringWholeChunk)，要等整段都写进来再处理
+static int readRingChunk(Decoder* de, InputRing* r, RingMark* m, uint32_t head) {
+	if ((int32_t)(m->end - head) > 0) {
+		return 0;
 	}
-	pthread_mutex_lock(&de->frameMutex);
-	item->next = NULL;
-	item->frame = frame;
-	if (de->frameTail == NULL) {
-		// 空链
-		de->frameHead = item;
-		de->frameTail = item;
-	} else {
-		de->frameTail->next = item;
-		de->frameTail = item;
+	uint32_t len = m->end - m->start;
+	uint32_t pos = m->start & (r->size - 1);
+	uint8_t* data = r->data + pos;
+	if (pos + len > r->size) {
+		// 跨过了环尾，拼起来
+		av_fast_padded_malloc(&de->packetScratch, &de->packetScratchSize, len);
+		if (de->packetScratch) {
+			uint32_t first = r->size - pos;
+			memcpy(de->packetScratch, data, first);
+			memcpy(de->packetScratch + first, r->data, len - first);
+		} else {
+			av_log(NULL, AV_LOG_ERROR, "av_fast_padded_malloc err in readRingChunk: %u\n", len);
+		}
+		data = de->packetScratch;
 	}
-	pthread_mutex_unlock(&de->frameMutex);
-	return 0;
+	de->chunkTime = emscripten_get_now();
+	uint32_t used = len;
+	if (data && len > 0) {
+		// 环里的内存不是引用计数的，avcodec_send_packet 会拷贝一份
+		if (m->flags & BUFFER_FLAG_PACKET) {
+			sendInputPacket(de, NULL, data, len, m->flags, msToTs(m->pts), msToTs(m->dts));
+		} else {
+			used = parseData(de, data, len, msToTs(m->pts), msToTs(m->dts), 1);
+		}
+	}
+	STATS_ADD(de, bytesIn, used);
+	__atomic_store_n(&r->tail, m->start + used, __ATOMIC_RELEASE);
+	if (used < len) {
+		// 包没送进去，剩下的以后按普通数据接着 parse
+		return used > 0 ? used : 1;
+	}
+	if (!(m->flags & BUFFER_FLAG_PACKET)) {
+		endOfChunk(de, m->flags);
+	}
+	__atomic_store_n(&r->markTail, r->markTail + 1, __ATOMIC_RELEASE);
+	return len > 0 ? len : 1;
 }
 
-Frame* getFrame(void *ctx) {
-	if (!ctx) {
-		return NULL;
+// 记下第一次读到数据的时间，算首帧时间用
+static void markFirstInput(Decoder* de) {
+	if (de->stats.firstInputTime == 0) {
+		de->stats.firstInputTime = emscripten_get_now();
 	}
-	Decoder* de = (Decoder*)ctx;
+}
 
-	Frame *ret = NULL;
-	pthread_mutex_lock(&de->frameMutex);
-	FrameList *head = de->frameHead;
-	if (head) {
-		ret = head->frame;
-		de->frameHead = head->next;
-		if (de->frameHead == NULL) {
-			de->frameTail = NULL;
+enum {
+	RING_IDLE,			// 没有能处理的
+	RING_DATA,			// parse [tail, limit) 的数据
+	RING_CHUNK,			// 整段处理标记的数据，见 readRingChunk
+	RING_END_OF_CHUNK,	// 标记的数据都 parse 完了，处理它的 flags
+};
+
+// 环里下一步要做什么，readRing 和 decoderHasWork 用同一个判断，不会一个说有活一个读不出来
+// 先读 head 再读 markHead，js 写标记在写 head 之前，读到的数据后面如果有标记一定能读到
+static int ringNextStep(Decoder* de, InputRing* r, uint32_t head, uint32_t tail, uint32_t markTail, RingMark** mark, uint32_t* limit) {
+	*mark = NULL;
+	*limit = head;
+	if (markTail != __atomic_load_n(&r->markHead, __ATOMIC_ACQUIRE)) {
+		RingMark* m = &r->marks[markTail % RING_MARK_COUNT];
+		*mark = m;
+		if ((int32_t)(m->start - tail) > 0) {
+			// 标记前面还有不带时间戳的数据
+			*limit = m->start;
+		} else if (tail == m->start && ringWholeChunk(de, r, m)) {
+			// 要等整段都写进来
+			return (int32_t)(m->end - head) > 0 ? RING_IDLE : RING_CHUNK;
+		} else if ((int32_t)(m->end - tail) <= 0) {
+			return RING_END_OF_CHUNK;
+		} else {
+			*limit = m->end;
+		}
+		if ((int32_t)(*limit - head) > 0) {
+			*limit = head;
 		}
-		free(head);
 	}
-	pthread_mutex_unlock(&de->frameMutex);
-	return ret;
+	return *limit != tail ? RING_DATA : RING_IDLE;
 }
 
-// 输入新的数据
-int putBuffer(void *ctx, unsigned char *buf, int len) {
-	av_log(NULL, AV_LOG_DEBUG, "putBuffer %d\n", len);
-	if (!ctx) {
-		return -1;
+// 从环形缓冲读，直接在环里 parse，不拷贝。一次只处理到环尾或下一个标记，回绕的部分下次再读
+static int readRing(Decoder* de) {
+	InputRing* r = de->ring;
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint32_t tail = r->tail;
+	uint32_t markTail = r->markTail;
+	uint32_t limit;
+	RingMark* m;
+	int64_t pts = AV_NOPTS_VALUE;
+	int64_t dts = AV_NOPTS_VALUE;
+	switch (ringNextStep(de, r, head, tail, markTail, &m, &limit)) {
+	case RING_IDLE:
+		return 0;
+	case RING_CHUNK:
+		markFirstInput(de);
+		return readRingChunk(de, r, m, head);
+	case RING_END_OF_CHUNK:
+		endOfChunk(de, m->flags);
+		__atomic_store_n(&r->markTail, markTail + 1, __ATOMIC_RELEASE);
+		return 1;
 	}
-	Decoder* de = (Decoder*)ctx;
-	BufferList *item = malloc(sizeof(BufferList));
-	if (!item) {
-		av_log(NULL, AV_LOG_ERROR, "malloc err in putBuffer\n");
-		return -1;
+	if (m && tail == m->start) {
+		// 环尾回绕时一段数据分两次读，时间戳只在第一次给
+		pts = msToTs(m->pts);
+		dts = msToTs(m->dts);
 	}
-	pthread_mutex_lock(&de->bufferMutex);
-	item->next = NULL;
-	item->buf = buf;
-	item->len = len;
-	if (de->bufferTail == NULL) {
-		// 空链
-		de->bufferHead = item;
-		de->bufferTail = item;
-	} else {
-		de->bufferTail->next = item;
-		de->bufferTail = item;
+	uint32_t avail = limit - tail;
+	markFirstInput(de);
+	uint32_t pos = tail & (r->size - 1);
+	uint32_t n = r->size - pos;
+	if (n > avail) {
+		n = avail;
 	}
-	pthread_mutex_unlock(&de->bufferMutex);
-	return 0;
+	// js 写进环的时间不知道，按解码线程读到的时间算
+	de->chunkTime = emscripten_get_now();
+	// 包没送进去时只用掉一部分，剩下的下次接着 parse
+	n = parseData(de, r->data + pos, n, pts, dts, 0);
+	STATS_ADD(de, bytesIn, n);
+	__atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+	return n > 0 ? n : 1;
 }
 
-// 读buffer
-int readBuffer(void *ctx, unsigned char* buf, int buf_size) {
-	int ret = -(0x20464F45); // 'EOF '
-	if (!ctx) {
-		return -1;
+// 启用输入环形缓冲，size 会向上取成2的幂，要在第一次输入数据之前调用
+// 返回环的描述结构给 js 直接写
+InputRing* enableInputRing(void *ctx, int size) {
+	if (!ctx || size <= 0) {
+		return NULL;
 	}
 	Decoder* de = (Decoder*)ctx;
-	av_log(NULL, AV_LOG_DEBUG, "readBuffer %p %p\n", de->bufferHead, de->bufferTail);
-	
+	if (de->ring) {
+		return de->ring;
+	}
+	uint32_t cap = 1;
+	while (cap < (uint32_t)size && cap < 0x40000000) {
+		cap <<= 1;
+	}
+	InputRing* r = av_mallocz(sizeof(InputRing));
+	if (!r) {
+		av_log(NULL, AV_LOG_ERROR, "av_mallocz err in enableInputRing\n");
+		return NULL;
+	}
+	r->data = av_mallocz(cap + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (!r->data) {
+		av_log(NULL, AV_LOG_ERROR, "av_mallocz err in enableInputRing: %u\n", cap);
+		av_free(r);
+		return NULL;
+	}
+	r->size = cap;
+	r->wake = &g_decodePool.wakeSeq;
+	r->markCount = RING_MARK_COUNT;
+	__atomic_store_n(&de->ring, r, __ATOMIC_RELEASE);
+	return r;
+}
+
+// 读 bufferList 里的第一块数据，直接在 js 传进来的内存上 parse，不拷贝，parse 完再释放
+// 只有解码线程会删链表头，所以 parse 的时候不用持锁
+static int readBuffer(Decoder* de) {
 	pthread_mutex_lock(&de->bufferMutex);
 	BufferList *head = de->bufferHead;
-	if (head) {		
-		if (buf_size >= head->len) {
-			// 取出第一块buf
-			memcpy(buf, head->buf, head->len);
-			ret = head->len;
-			de->bufferHead = head->next;
-			if (de->bufferHead == NULL) {
-				// 取空了
-				de->bufferTail = NULL;
+	pthread_mutex_unlock(&de->bufferMutex);
+	if (!head) {
+		return 0;
+	}
+	av_log(NULL, AV_LOG_DEBUG, "readBuffer %p %d\n", head->buf, head->len);
+	markFirstInput(de);
+	de->chunkTime = head->putTime;
+	if (head->flags & BUFFER_FLAG_PACKET) {
+		STATS_ADD(de, bytesIn, head->len);
+		if (head->len > 0) {
+			// 包直接引用 js 分配的内存，解码器用完时释放
+			AVBufferRef* ref = av_buffer_create(head->buf, head->len + AV_INPUT_BUFFER_PADDING_SIZE, freeInputBuffer, NULL, 0);
+			if (ref) {
+				sendInputPacket(de, ref, head->buf, head->len, head->flags, head->pts, head->dts);
+				head->buf = NULL;
+			} else {
+				av_log(NULL, AV_LOG_ERROR, "av_buffer_create err in readBuffer\n");
 			}
-			// 释放内存
-			free(head->buf);	// 这个内存是js里面分配的
-			free(head);
-		} else {
-			memcpy(buf, head->buf, buf_size);
-			int nlen = head->len - buf_size;
-			memmove(head->buf, head->buf + buf_size, nlen);
-			head->len = nlen;
-			ret = buf_size;
+		}
+	} else {
+		// parser 对齐时以 AU 结尾的一块就是完整的 AU，整段送出去，不用等下一块的起始码，也不用冲 parser
+		int offset = de->bufferOffset;
+		int complete = offset == 0 && (head->flags & BUFFER_FLAG_END_OF_AU) && de->parserAligned;
+		// 接着上次没 parse 完的地方时不再给时间戳
+		int used = parseData(de, head->buf + offset, head->len - offset,
+			offset == 0 ? head->pts : AV_NOPTS_VALUE, offset == 0 ? head->dts : AV_NOPTS_VALUE, complete);
+		STATS_ADD(de, bytesIn, used);
+		if (offset + used < head->len) {
+			// 包没送进去，这块先留着，剩下的下次接着 parse
+			de->bufferOffset = offset + used;
+			return used > 0 ? used : 1;
+		}
+		de->bufferOffset = 0;
+		if (head->flags) {
+			endOfChunk(de, head->flags);
 		}
 	}
+	int ret = head->len > 0 ? head->len : 1;	// 只带 flags 的空数据也算处理了一块
+
+	pthread_mutex_lock(&de->bufferMutex);
+	de->bufferHead = head->next;
+	if (de->bufferHead == NULL) {
+		// 取空了
+		de->bufferTail = NULL;
+	}
 	pthread_mutex_unlock(&de->bufferMutex);
+	__atomic_sub_fetch(&de->bufferBytes, head->len, __ATOMIC_RELAXED);
+	// 释放内存
+	free(head->buf);	// 这个内存是js里面分配的
+	free(head);
 	return ret;
 }
 
-void *decodeThreadFun(void *ctx) {
-	if (!ctx) {
-		av_log(NULL, AV_LOG_ERROR, "decodeThreadFun without ctx.\n"); 
-		return NULL;
+// 处理一块输入，返回 >0 表示有进展
+static int decodeStep(Decoder* de) {
+	if (!pumpDecoder(de)) {
+		return 0;
 	}
-	Decoder* de = (Decoder*)ctx;
-	while (!de->needStop){
-		// av_log(NULL, AV_LOG_DEBUG, "decodeThreadFun while.\n");
-		// 读数据
-		int n = readBuffer(de, de->io_buffer, de->io_buffer_size);
-		if (n <= 0) {
-			usleep(10000);
+	if (__atomic_load_n(&de->ring, __ATOMIC_ACQUIRE)) {
+		return readRing(de);
+	}
+	return readBuffer(de);
+}
+
+// 解码器是否有要处理的数据，不持有解码器的锁，读到的可能是旧的，只用来挑解码器
+static int decoderHasWork(Decoder* de) {
+	// 阻塞模式下输出队列满了，等 getFrame 取走再解
+	if (frameQueueFull(de)) {
+		return 0;
+	}
+	// 上次因为输出队列满了没做完的
+	if (de->held || de->pendingFlags || de->drainState != DRAIN_NONE || de->outputPending) {
+		return 1;
+	}
+	InputRing* r = __atomic_load_n(&de->ring, __ATOMIC_ACQUIRE);
+	if (r) {
+		uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		uint32_t markTail = __atomic_load_n(&r->markTail, __ATOMIC_ACQUIRE);
+		uint32_t limit;
+		RingMark* m;
+		if (ringNextStep(de, r, head, tail, markTail, &m, &limit) == RING_IDLE) {
+			return 0;
+		}
+	} else if (!__atomic_load_n(&de->bufferHead, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	return 1;
+}
+
+// 找一个有数据要处理、没有被别的线程占着的解码器，占住它
+// 先看优先级，同优先级的按截止时间(开始等的时间 + deadline)最早的先解
+static Decoder* claimDecoder(DecodePool* pool) {
+	Decoder* ret = NULL;
+	double retDeadline = 0;
+	double now = emscripten_get_now();
+	pthread_mutex_lock(&pool->mutex);
+	int top = INT_MIN;
+	int bottom = INT_MAX;
+	int ready = 0;
+	for (int i = 0; i < pool->count; i++) {
+		Decoder* de = pool->decoders[i];
+		if (de->needStop || !decoderHasWork(de)) {
+			de->readySince = 0;
 			continue;
 		}
-		av_log(NULL, AV_LOG_DEBUG, "decodeThreadFun new data %d.\n", n);
-		// parse
-		uint8_t* buf = de->io_buffer;
-		while (n > 0) {
-			int ret = av_parser_parse2(de->parser, de->ctx, &(de->packet->data), &(de->packet->size), 
-				buf, n, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
-			av_log(NULL, AV_LOG_DEBUG, "decodeThreadFun av_parser_parse2 ret %d.\n", ret);
-			if (ret < 0) {
-				av_log(NULL, AV_LOG_VERBOSE, "av_parser_parse2 ret %d\n", ret);
+		if (de->readySince == 0) {
+			de->readySince = now;
+		}
+		if (de->priority > top) {
+			top = de->priority;
+		}
+		if (de->priority < bottom) {
+			bottom = de->priority;
+		}
+		ready++;
+		if (de->busy) {
+			continue;
+		}
+		double deadline = de->readySince + de->deadline;
+		if (!ret || de->priority > ret->priority || (de->priority == ret->priority && deadline < retDeadline)) {
+			ret = de;
+			retDeadline = deadline;
+		}
+	}
+	if (top != INT_MIN) {
+		pool->topPriority = top;
+		pool->bottomPriority = bottom;
+		pool->readyCount = ready;
+	}
+	if (ret) {
+		ret->busy = 1;
+		if (now > retDeadline) {
+			ret->missed++;
+		}
+		ret->readySince = 0;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return ret;
+}
+
+// 每个统计周期按 cpu 占用和错过截止时间的情况调整自动降级，要持有池的 mutex
+// 超了 cpu 预算，或者不是最高优先级又来不及解的，降一级；都没有的升一级
+// 几路一起等着解、优先级又都一样时没有谁是后台，来不及解的都降，不然同优先级的多路过载时谁都不降
+static void updateSchedule(DecodePool* pool, Decoder* de, double start, double end) {
+	de->busyTime += end - start;
+	if (de->windowStart == 0) {
+		de->windowStart = start;
+	}
+	double window = end - de->windowStart;
+	if (window < SCHED_WINDOW) {
+		return;
+	}
+	double load = de->busyTime / window;
+	int over = de->budget > 0 && load > de->budget;
+	int uniform = pool->topPriority == pool->bottomPriority && pool->readyCount > 1;
+	int late = de->missed > 0 && (de->priority < pool->topPriority || uniform);
+	if ((over || late) && de->autoSkip < AUTO_SKIP_MAX) {
+		de->autoSkip++;
+	} else if (!over && !late && de->autoSkip > AUTO_SKIP_NONE) {
+		de->autoSkip--;
+	}
+	de->stats.autoSkip = de->autoSkip;
+	de->stats.cpuLoad = (int)(load * 100);
+	de->busyTime = 0;
+	de->missed = 0;
+	de->windowStart = end;
+}
+
+static void unclaimDecoder(DecodePool* pool, Decoder* de, double start) {
+	double end = emscripten_get_now();
+	pthread_mutex_lock(&pool->mutex);
+	updateSchedule(pool, de, start, end);
+	de->busy = 0;
+	pthread_mutex_unlock(&pool->mutex);
+	// releaseDecoder 可能在等
+	emscripten_futex_wake(&de->busy, 1);
+}
+
+void *decodeThreadFun(void *ctx) {
+	DecodePool* pool = (DecodePool*)ctx;
+	while (1) {
+		// 先取 wakeSeq 再找，找不到就等 putBuffer/js 写环/getFrame 唤醒，不会漏掉
+		int seq = __atomic_load_n(&pool->wakeSeq, __ATOMIC_SEQ_CST);
+		Decoder* de = claimDecoder(pool);
+		if (!de) {
+			emscripten_futex_wait(&pool->wakeSeq, seq, INFINITY);
+			continue;
+		}
+		double start = emscripten_get_now();
+		for (int i = 0; i < DECODE_BATCH && !de->needStop; i++) {
+			// 输出队列满了就换别的解码器，不在这里阻塞
+			if (i > 0 && !decoderHasWork(de)) {
 				break;
 			}
-			buf += ret;
-			n -= ret;
-			if (de->packet->size > 0) {
-				ret = avcodec_send_packet(de->ctx, de->packet);
-				av_log(NULL, AV_LOG_DEBUG, "decodeThreadFun avcodec_send_packet ret %d.\n", ret);
-				if (ret < 0) {
-					av_log(NULL, AV_LOG_VERBOSE, "avcodec_send_packet ret: %d\n", ret);
-				}
-			}
-		}
-		while (1) {
-			Frame *f = recvFrame(de);
-			if (!f) {
-				av_log(NULL, AV_LOG_DEBUG, "no new frame\n");
+			int n = decodeStep(de);
+			if (n <= 0) {
 				break;
 			}
-			av_log(NULL, AV_LOG_DEBUG, "got frame\n");
-			putFrame(de, f);
+			av_log(NULL, AV_LOG_DEBUG, "decodeThreadFun new data %d.\n", n);
 		}
+		unclaimDecoder(pool, de, start);
 	}
 	return NULL;
 }
 
+// 设置解码线程数，所有解码器共用，只能增加，<=0 时按 cpu 核数
+int setDecodeThreads(int n) {
+	DecodePool* pool = &g_decodePool;
+	if (n <= 0) {
+		n = emscripten_num_logical_cores();
+	}
+	if (n > DECODE_MAX_THREADS) {
+		n = DECODE_MAX_THREADS;
+	}
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->threads < n) {
+		pthread_t tid;
+		int ret = pthread_create(&tid, NULL, decodeThreadFun, pool);
+		if (ret != 0) {
+			av_log(NULL, AV_LOG_ERROR, "pthread_create decode thread fail %d.\n", ret);
+			break;
+		}
+		pthread_detach(tid);
+		pool->threads++;
+	}
+	n = pool->threads;
+	pthread_mutex_unlock(&pool->mutex);
+	return n;
+}
+
+// 设置调度参数，可以随时调用
+// priority: 优先级，大的先解，前台的画面给高优先级
+// deadline: 有数据之后最多等多久(ms)开始解，<=0 时用默认值，同优先级的截止时间早的先解
+// budget: cpu 预算，占一个线程时间的百分比，超了自动降级丢帧，<=0 表示不限
+// 不是最高优先级的解码器来不及解时也会自动降级(不解非参考帧，再不行只解关键帧)，空闲了再恢复
+int setSchedule(void *ctx, int priority, double deadline, int budget) {
+	if (!ctx) {
+		return -1;
+	}
+	Decoder* de = (Decoder*)ctx;
+	pthread_mutex_lock(&g_decodePool.mutex);
+	de->priority = priority;
+	de->deadline = deadline > 0 ? deadline : DEFAULT_DEADLINE;
+	de->budget = budget > 0 ? budget / 100.0 : 0;
+	pthread_mutex_unlock(&g_decodePool.mutex);
+	wakeDecodePool();
+	return 0;
+}
+
+// 把解码器加进解码线程池，池里还没有线程时按 cpu 核数启动
+static int registerDecoder(Decoder* de) {
+	DecodePool* pool = &g_decodePool;
+	if (__atomic_load_n(&pool->threads, __ATOMIC_RELAXED) == 0 && setDecodeThreads(0) <= 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->count >= pool->capacity) {
+		int capacity = pool->capacity > 0 ? pool->capacity * 2 : 16;
+		Decoder **decoders = realloc(pool->decoders, sizeof(Decoder*) * capacity);
+		if (!decoders) {
+			pthread_mutex_unlock(&pool->mutex);
+			av_log(NULL, AV_LOG_ERROR, "realloc err in registerDecoder\n");
+			return -1;
+		}
+		pool->decoders = decoders;
+		pool->capacity = capacity;
+	}
+	pool->decoders[pool->count++] = de;
+	de->registered = 1;
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
+
+// 从解码线程池里去掉，等正在处理它的线程处理完
+static void unregisterDecoder(Decoder* de) {
+	DecodePool* pool = &g_decodePool;
+	if (!de->registered) {
+		return;
+	}
+	pthread_mutex_lock(&pool->mutex);
+	for (int i = 0; i < pool->count; i++) {
+		if (pool->decoders[i] == de) {
+			pool->decoders[i] = pool->decoders[--pool->count];
+			break;
+		}
+	}
+	while (de->busy) {
+		pthread_mutex_unlock(&pool->mutex);
+		emscripten_futex_wait(&de->busy, 1, INFINITY);
+		pthread_mutex_lock(&pool->mutex);
+	}
+	de->registered = 0;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
 void releaseDecoder(void *ctx) {
 	if (!ctx) {
 		return;
 	}
 	Decoder* de = (Decoder*)ctx;
-	de->needStop = 1; // 停止线程
-	pthread_join(de->decodeThread, NULL);
-	if (de->sws) {
-		sws_freeContext(de->sws);
-		de->sws = NULL;
+	de->needStop = 1; // 停止解码
+	wakeDecodePool();
+	unregisterDecoder(de);
+	// 之后解码线程不会再发通知，已经发了还没执行的，等它执行时再释放
+	if (__atomic_load_n(&de->notifyPending, __ATOMIC_SEQ_CST) || de->delivering) {
+		de->zombie = 1;
+		return;
+	}
+	freeDecoder(de);
+}
+
+static void freeDecoder(Decoder* de) {
+	freeSwsCache(de);
+	if (de->scratch) {
+		av_freep(&de->scratch);
 	}
+	av_freep(&de->packetScratch);
 	if (de->packet) {
 		av_packet_free(&(de->packet));
 		de->packet = NULL;
 	}
+	if (de->heldPacket) {
+		av_packet_free(&(de->heldPacket));
+	}
 	if (de->frameYUV) {
 		av_frame_free(&(de->frameYUV));
 		de->frameYUV = NULL;
@@ -393,6 +2308,9 @@ void releaseDecoder(void *ctx) {
 		av_frame_free(&(de->frameRGBA));
 		de->frameRGBA = NULL;
 	}
+	if (de->frameNext) {
+		av_frame_free(&(de->frameNext));
+	}
 	if (de->ctx) {
 		avcodec_close(de->ctx);
 		avcodec_free_context(&(de->ctx));
@@ -414,12 +2332,32 @@ void releaseDecoder(void *ctx) {
 		av_free(de->io_buffer);
 		de->io_buffer = NULL;
 	}
+	if (de->frameQueue) {
+		Frame *f = NULL;
+		while ((f = popFrameLocked(de)) != NULL) {
+			releaseFrame(de, f);
+		}
+		free(de->frameQueue);
+		de->frameQueue = NULL;
+		destroyFramePool(de);
+	}
+	if (de->ring) {
+		av_free(de->ring->data);
+		av_free(de->ring);
+		de->ring = NULL;
+	}
 	free(de);
 
 	av_log(NULL, AV_LOG_DEBUG, "releaseDecoder end");
 }
 
-void* createDecoder(const char* fmt_name, enum AVCodecID type_id) {
+// threadCount: 解码器内部线程数，<=0 时由 ffmpeg 自己决定
+// threadType: DECODER_THREAD_FRAME / DECODER_THREAD_SLICE，可以或起来
+// flags: DECODER_FLAG_*
+// extradata: mp4/flv 里的 avcC/hvcC(或者 Annex B 的 SPS/PPS)，可以为 NULL，会拷贝一份，调用方自己释放
+//   给了 avcC/hvcC 时，之后用 putPacket 直接输入长度前缀格式的 sample，不用转成 Annex B
+void* createDecoder(const char* fmt_name, enum AVCodecID type_id, int threadCount, int threadType, int flags, 
+	const uint8_t* extradata, int extradataSize) {
 	int ret = 0;
 
 	Decoder* de = malloc(sizeof(Decoder));
@@ -429,6 +2367,9 @@ void* createDecoder(const char* fmt_name, enum AVCodecID type_id) {
 	}
 	memset(de, 0, sizeof(Decoder));
 
+	de->deadline = DEFAULT_DEADLINE;
+	de->parserAligned = 1;
+
 	de->codec = avcodec_find_decoder(type_id);
     if (!de->codec) {
         av_log(NULL, AV_LOG_ERROR, "avcodec_find_decoder fail.\n"); 
@@ -448,6 +2389,33 @@ void* createDecoder(const char* fmt_name, enum AVCodecID type_id) {
         return NULL;
     }
 
+	// 多线程解码，要在 avcodec_open2 之前设置
+	de->ctx->thread_count = threadCount > 0 ? threadCount : 0;
+	de->ctx->pkt_timebase = (AVRational){1, TIME_BASE};
+	if (threadType & (DECODER_THREAD_FRAME | DECODER_THREAD_SLICE)) {
+		de->ctx->thread_type = threadType & (DECODER_THREAD_FRAME | DECODER_THREAD_SLICE);
+	}
+	if (flags & DECODER_FLAG_LIVE) {
+		// 帧级多线程每个线程都要攒一帧，实时模式只用 slice 多线程
+		// 重排序延迟由码流决定(has_b_frames)，没有 B 帧的流解出来立刻输出
+		de->ctx->thread_type = DECODER_THREAD_SLICE;
+		de->ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		de->stats.lowDelay = 1;
+	}
+	av_log(NULL, AV_LOG_DEBUG, "createDecoder %s thread_count: %d, thread_type: %d\n", fmt_name, de->ctx->thread_count, de->ctx->thread_type);
+
+	// 解码器在 avcodec_open2 里解析 extradata，是 avcC/hvcC 时记下 NAL 长度的字节数，之后的包按长度前缀解析
+	if (extradata && extradataSize > 0) {
+		de->ctx->extradata = av_mallocz(extradataSize + AV_INPUT_BUFFER_PADDING_SIZE);
+		if (!de->ctx->extradata) {
+			av_log(NULL, AV_LOG_ERROR, "av_mallocz extradata fail %d.\n", extradataSize);
+			releaseDecoder(de);
+			return NULL;
+		}
+		memcpy(de->ctx->extradata, extradata, extradataSize);
+		de->ctx->extradata_size = extradataSize;
+	}
+
 	ret = avcodec_open2(de->ctx, de->codec, NULL);
 	if (ret < 0) {
 		av_log(NULL, AV_LOG_ERROR, "avcodec_open2 fail %d.\n", ret);
@@ -456,7 +2424,8 @@ void* createDecoder(const char* fmt_name, enum AVCodecID type_id) {
 	}
 
 	de->packet = av_packet_alloc();
-	if (!de->packet) {
+	de->heldPacket = av_packet_alloc();
+	if (!de->packet || !de->heldPacket) {
 		av_log(NULL, AV_LOG_ERROR, "av_packet_alloc fail.");
 		releaseDecoder(de);
 		return NULL;
@@ -469,32 +2438,26 @@ void* createDecoder(const char* fmt_name, enum AVCodecID type_id) {
 		return NULL;
 	}
 	de->frameRGBA = av_frame_alloc();
-	if (!de->frameRGBA) {
+	de->frameNext = av_frame_alloc();
+	if (!de->frameRGBA || !de->frameNext) {
 		av_log(NULL, AV_LOG_ERROR, "av_frame_alloc RGBA fail.");
 		releaseDecoder(de);
 		return NULL;
 	}
 
-	de->io_buffer_size = 4096;
-	de->io_buffer = av_malloc(de->io_buffer_size);
-	if (!de->io_buffer) {
-		av_log(NULL, AV_LOG_ERROR, "av_malloc fail.\n");
-		releaseDecoder(de);
-		return NULL;
-	}
-
 	// 队列
 	de->bufferHead = NULL;
 	de->bufferTail = NULL;
-	de->frameHead = NULL;
-	de->frameTail = NULL;
-
-	// 创建解码线程
 	pthread_mutex_init(&de->bufferMutex, NULL);
 	pthread_mutex_init(&de->frameMutex, NULL);
-	ret = pthread_create(&de->decodeThread, NULL, decodeThreadFun, de);
-	if (ret != 0) {
-		av_log(NULL, AV_LOG_ERROR, "pthread_create fail %d.\n", ret);
+	pthread_mutex_init(&de->pool.mutex, NULL);
+	if (setFrameQueue(de, DEFAULT_FRAME_QUEUE_DEPTH, FRAME_POLICY_BLOCK) < 0) {
+		releaseDecoder(de);
+		return NULL;
+	}
+
+	// 交给解码线程池
+	if (registerDecoder(de) < 0) {
 		releaseDecoder(de);
 		return NULL;
 	}
@@ -502,12 +2465,12 @@ void* createDecoder(const char* fmt_name, enum AVCodecID type_id) {
 	return de;
 }
 
-void* createH264Decoder() {
-	return createDecoder("h264", AV_CODEC_ID_H264);
+void* createH264Decoder(int threadCount, int threadType, int flags, const uint8_t* extradata, int extradataSize) {
+	return createDecoder("h264", AV_CODEC_ID_H264, threadCount, threadType, flags, extradata, extradataSize);
 }
 
-void* createH265Decoder() {
-	return createDecoder("hevc", AV_CODEC_ID_H265);
+void* createH265Decoder(int threadCount, int threadType, int flags, const uint8_t* extradata, int extradataSize) {
+	return createDecoder("hevc", AV_CODEC_ID_H265, threadCount, threadType, flags, extradata, extradataSize);
 }
 
 #if 0
@@ -0,0 +1,239 @@
+// 在 node 的 worker_threads 里跑 WorkerDecoder 的冒烟测试：npm test
+// 码流是这里生成的 16x16 的 H.264，每帧一个 I_PCM 宏块，像素值是已知的，不依赖外部文件
+import WorkerDecoder from '../worker_decoder.js'
+
+const FRAME_COUNT = 30
+const TIMEOUT = 30000
+const WIDTH = 16
+const HEIGHT = 16
+const LUMA = 128 // 灰色，rgba 里是 (128 - 16) * 1.164 = 130
+const QUEUE_DEPTH = 4 // 背压测试用的主线程队列长度
+const STALL_TIME = 300 // 背压测试里先不取帧的时间
+const FRAME_INTERVAL = 40 // put 时给的时间戳间隔(ms)
+const SETTLE_TIME = 100 // flush 完之后再等一会儿，确认没有帧跟在 'flushed' 后面
+
+// 按位写 RBSP
+class BitWriter {
+  constructor() {
+    this.bytes = []
+    this.cur = 0
+    this.bits = 0
+  }
+
+  u(n, v) {
+    for (let i = n - 1; i >= 0; i--) {
+      this.cur = (this.cur << 1) | ((v >> i) & 1)
+      if (++this.bits === 8) {
+        this.bytes.push(this.cur)
+        this.cur = 0
+        this.bits = 0
+      }
+    }
+  }
+
+  ue(v) {
+    const len = 32 - Math.clz32(v + 1)
+    this.u(len - 1, 0)
+    this.u(len, v + 1)
+  }
+
+  se(v) {
+    this.ue(v > 0 ? v * 2 - 1 : -v * 2)
+  }
+
+  aligned() {
+    return this.bits === 0
+  }
+
+  // rbsp_trailing_bits
+  trailing() {
+    this.u(1, 1)
+    while (!this.aligned()) {
+      this.u(1, 0)
+    }
+  }
+}
+
+// 加起始码和防竞争字节
+function nal(header, rbsp) {
+  const out = [0, 0, 0, 1, header]
+  let zeros = 0
+  for (const b of rbsp) {
+    if (zeros >= 2 && b <= 3) {
+      out.push(3)
+      zeros = 0
+    }
+    out.push(b)
+    zeros = b === 0 ? zeros + 1 : 0
+  }
+  return out
+}
+
+function sps() {
+  const w = new BitWriter()
+  w.u(8, 66) // baseline
+  w.u(8, 0)
+  w.u(8, 10) // level 1.0
+  w.ue(0) // seq_parameter_set_id
+  w.ue(0) // log2_max_frame_num_minus4
+  w.ue(2) // pic_order_cnt_type，按解码顺序输出
+  w.ue(1) // max_num_ref_frames
+  w.u(1, 0)
+  w.ue(WIDTH / 16 - 1)
+  w.ue(HEIGHT / 16 - 1)
+  w.u(1, 1) // frame_mbs_only_flag
+  w.u(1, 1) // direct_8x8_inference_flag
+  w.u(1, 0) // frame_cropping_flag
+  w.u(1, 0) // vui_parameters_present_flag
+  w.trailing()
+  return nal(0x67, w.bytes)
+}
+
+function pps() {
+  const w = new BitWriter()
+  w.ue(0) // pic_parameter_set_id
+  w.ue(0) // seq_parameter_set_id
+  w.u(1, 0) // cavlc
+  w.u(1, 0)
+  w.ue(0) // num_slice_groups_minus1
+  w.ue(0)
+  w.ue(0)
+  w.u(1, 0)
+  w.u(2, 0)
+  w.se(0) // pic_init_qp_minus26
+  w.se(0)
+  w.se(0)
+  w.u(1, 1) // deblocking_filter_control_present_flag
+  w.u(1, 0)
+  w.u(1, 0)
+  w.trailing()
+  return nal(0x68, w.bytes)
+}
+
+// 一个 IDR 帧，只有一个 I_PCM 宏块
+function idr(n) {
+  const w = new BitWriter()
+  w.ue(0) // first_mb_in_slice
+  w.ue(7) // slice_type I
+  w.ue(0) // pic_parameter_set_id
+  w.u(4, 0) // frame_num
+  w.ue(n & 1) // idr_pic_id，相邻的 IDR 要不一样
+  w.u(1, 0) // no_output_of_prior_pics_flag
+  w.u(1, 0) // long_term_reference_flag
+  w.se(0) // slice_qp_delta
+  w.ue(1) // disable_deblocking_filter_idc
+  w.ue(25) // mb_type I_PCM
+  while (!w.aligned()) {
+    w.u(1, 0)
+  }
+  for (let i = 0; i < 256; i++) {
+    w.u(8, LUMA)
+  }
+  for (let i = 0; i < 128; i++) {
+    w.u(8, 128)
+  }
+  w.trailing()
+  return nal(0x65, w.bytes)
+}
+
+function fail(message) {
+  console.error('FAIL:', message)
+  process.exit(1)
+}
+
+// pic_order_cnt_type 2，输出顺序就是输入顺序，index 是第几帧
+function checkFrame(frame, index) {
+  if (frame.pts !== index * FRAME_INTERVAL) {
+    fail('frame ' + index + ' pts ' + frame.pts + ', want ' + index * FRAME_INTERVAL)
+  }
+  if (frame.width !== WIDTH || frame.height !== HEIGHT) {
+    fail('frame size ' + frame.width + 'x' + frame.height)
+  }
+  const v = frame.data[0]
+  if (Math.abs(v - 130) > 2 || frame.data[1] !== v || frame.data[2] !== v) {
+    fail('pixel ' + frame.data.subarray(0, 4).join(','))
+  }
+}
+
+function putStream(de) {
+  for (let i = 0; i < FRAME_COUNT; i++) {
+    const bytes = i === 0 ? sps().concat(pps(), idr(i)) : idr(i)
+    de.put(new Uint8Array(bytes), i * FRAME_INTERVAL, i * FRAME_INTERVAL, { endOfAU: true })
+  }
+  de.flush()
+}
+
+// onFrame 收帧，检查帧数和像素
+function testOnFrame(done) {
+  let frames = 0
+  const de = new WorkerDecoder('h264', {
+    onError: (message) => fail(message),
+    onFrame: (frame) => {
+      checkFrame(frame, frames)
+      frames++
+    }
+  })
+  putStream(de)
+  const check = () => {
+    if (de.flushing()) {
+      setTimeout(check, 10)
+      return
+    }
+    if (frames !== FRAME_COUNT) {
+      fail('got ' + frames + ' frames, want ' + FRAME_COUNT)
+    }
+    setTimeout(() => {
+      if (frames !== FRAME_COUNT) {
+        fail((frames - FRAME_COUNT) + ' frames arrived after flushed')
+      }
+      console.log('OK: ' + frames + ' frames decoded in worker_threads')
+      de.dispose()
+      done()
+    }, SETTLE_TIME)
+  }
+  check()
+}
+
+// 'block' 时主线程不取帧，这边攒的帧不能超过 queueDepth，取走之后剩下的帧和 flush 都能走完
+function testBlock(done) {
+  let frames = 0
+  let maxQueue = 0
+  const de = new WorkerDecoder('h264', {
+    queueDepth: QUEUE_DEPTH,
+    overflow: 'block',
+    onError: (message) => fail(message)
+  })
+  putStream(de)
+  const stallEnd = Date.now() + STALL_TIME
+  const check = () => {
+    const stats = de.getStats()
+    maxQueue = Math.max(maxQueue, stats ? stats.frameQueue : 0)
+    if (maxQueue > QUEUE_DEPTH) {
+      fail('main side queue ' + maxQueue + ' frames, queueDepth ' + QUEUE_DEPTH)
+    }
+    if (Date.now() >= stallEnd) {
+      let frame
+      while ((frame = de.get())) {
+        checkFrame(frame, frames)
+        frames++
+      }
+    }
+    if (de.flushing() || frames < FRAME_COUNT) {
+      setTimeout(check, 10)
+      return
+    }
+    if (frames !== FRAME_COUNT || de.get()) {
+      fail('block: got ' + frames + ' frames, want ' + FRAME_COUNT)
+    }
+    console.log('OK: block queue stayed within ' + QUEUE_DEPTH + ' frames (max ' + maxQueue + ')')
+    de.dispose()
+    done()
+  }
+  check()
+}
+
+setTimeout(() => fail('timeout, no frames or flushed after ' + TIMEOUT + 'ms'), TIMEOUT).unref()
+
+WorkerDecoder.setReadyCb(() => {
+  testOnFrame(() => testBlock(() => process.exit(0)))
+})
@@ -0,0 +1,183 @@
+// 在 Web Worker(或者 node 的 worker_threads)里运行解码器，主线程用 worker_decoder.js 里的 WorkerDecoder
+// 输入的数据和输出的帧都用 transfer 传，不拷贝
+import Decoder from './index.js'
+
+let gPort = null
+const gDecoders = new Map()
+const gPending = [] // 解码器还没准备好时收到的消息
+let gStarted = false
+
+// 和 WorkerDecoder 的默认输出队列长度一样
+const DEFAULT_QUEUE_DEPTH = 8
+
+function post(msg, transfer) {
+  gPort.postMessage(msg, transfer || [])
+}
+
+// 帧里的数据都是从 wasm 内存拷贝出来的，可以直接 transfer
+function frameBuffers(frame) {
+  if (frame.format === 'i420') {
+    return [frame.y.buffer, frame.u.buffer, frame.v.buffer]
+  }
+  return [frame.data.buffer]
+}
+
+// 有新帧时按主线程给的额度用 getFrames 取出来发过去
+// 'block' 时发过去还没被主线程取走的帧最多 queueDepth 帧，主线程取走后发 'ack' 还额度，
+// 没有额度时帧留在 wasm 的输出队列里，队列满了解码就暂停，两边的内存都不会一直涨
+class HostedDecoder {
+  constructor(id, typ, opts) {
+    this._id = id
+    this._flushPending = 0 // 还没告诉主线程完成了的 flush 次数
+    this._inFlight = 0 // 发给主线程还没被取走的帧数
+    this._setWindow(opts && opts.queueDepth, opts && opts.overflow)
+    opts = Object.assign({}, opts, {
+      zeroCopy: false,
+      onFrame: null,
+      onFrameReady: () => this._pull()
+    })
+    this._de = new Decoder(typ, opts)
+  }
+
+  _setWindow(depth, overflow) {
+    this._block = !overflow || overflow === 'block'
+    this._window = depth > 0 ? depth : DEFAULT_QUEUE_DEPTH
+  }
+
+  // 按额度取帧，丢帧模式下主线程自己丢，不限额度
+  // flush 完了(解码器在 flush 完时也会通知)并且输出队列取空了，跟在帧后面发 'flushed'
+  _pull() {
+    const de = this._de
+    if (!de) {
+      return
+    }
+    // 先看 flush 再取帧：flush 的帧都在 flushCount 加一之前进了队列
+    const flushed = this._flushPending > 0 && !de.flushing()
+    let frames = []
+    let drained = false
+    while (true) {
+      const max = this._block ? this._window - this._inFlight - frames.length : 0
+      if (this._block && max <= 0) {
+        break
+      }
+      const got = de.getFrames(max)
+      if (got.length === 0) {
+        drained = true
+        break
+      }
+      frames = frames.concat(got)
+    }
+    if (frames.length > 0) {
+      this._inFlight += frames.length
+      let transfer = []
+      for (const frame of frames) {
+        transfer = transfer.concat(frameBuffers(frame))
+      }
+      post({ cmd: 'frames', id: this._id, frames, stats: de.getStats() }, transfer)
+    }
+    if (flushed && drained) {
+      post({ cmd: 'flushed', id: this._id, n: this._flushPending, stats: de.getStats() })
+      this._flushPending = 0
+    }
+  }
+
+  handle(msg) {
+    const de = this._de
+    switch (msg.cmd) {
+      case 'put':
+        de.put(new Uint8Array(msg.buf), msg.pts, msg.dts, msg.opts)
+        break
+      case 'putPacket':
+        de.putPacket(new Uint8Array(msg.buf), msg.pts, msg.dts, msg.opts)
+        break
+      case 'flush':
+        this._flushPending++
+        de.flush()
+        break
+      case 'ack':
+        this._inFlight -= msg.n
+        this._pull()
+        break
+      case 'setFrameQueue':
+        de.setFrameQueue(msg.args[0], msg.args[1])
+        this._setWindow(msg.args[0], msg.args[1])
+        this._pull()
+        break
+      case 'setOutputFormat':
+        de.setOutputFormat(msg.args[0])
+        break
+      case 'setOutputSize':
+        de.setOutputSize(msg.args[0], msg.args[1], msg.args[2])
+        break
+      case 'setSkipMode':
+        de.setSkipMode(msg.args[0])
+        break
+      case 'setSchedule':
+        de.setSchedule(msg.args[0])
+        break
+      case 'dispose':
+        this._de = null
+        de.dispose()
+        break
+      default:
+        break
+    }
+  }
+}
+
+function handle(msg) {
+  if (!gStarted) {
+    gPending.push(msg)
+    return
+  }
+  switch (msg.cmd) {
+    case 'setLogLevel':
+      Decoder.setLogLevel(msg.level)
+      break
+    case 'setDecodeThreads':
+      Decoder.setDecodeThreads(msg.n)
+      break
+    case 'setConvertThreads':
+      Decoder.setConvertThreads(msg.n)
+      break
+    case 'create':
+      try {
+        gDecoders.set(msg.id, new HostedDecoder(msg.id, msg.typ, msg.opts))
+      } catch (e) {
+        post({ cmd: 'error', id: msg.id, message: String(e && e.message || e) })
+      }
+      break
+    default: {
+      const de = gDecoders.get(msg.id)
+      if (!de) {
+        break
+      }
+      de.handle(msg)
+      if (msg.cmd === 'dispose') {
+        gDecoders.delete(msg.id)
+      }
+      break
+    }
+  }
+}
+
+async function start() {
+  if (typeof self !== 'undefined' && typeof self.postMessage === 'function') {
+    gPort = self
+    self.onmessage = (e) => handle(e.data)
+  } else {
+    // node 的 worker_threads
+    const { parentPort } = await import('worker_threads')
+    gPort = parentPort
+    parentPort.on('message', handle)
+  }
+  Decoder.setReadyCb(() => {
+    gStarted = true
+    for (const msg of gPending.splice(0)) {
+      handle(msg)
+    }
+    post({ cmd: 'ready' })
+  })
+}
+
+start()
@@ -0,0 +1,308 @@
+// 解码器放在 worker 里运行的版本，接口和 index.js 里的 Decoder 一样，主线程只负责收发消息
+// put 的数据 transfer 给 worker，worker 解出来的帧也 transfer 回来，主线程不做拷贝和加锁
+// 浏览器里用 Web Worker，node 里用 worker_threads
+
+let gWorker = null
+let gReady = false
+const gReadyCbs = []
+const gDecoders = new Map()
+let gNextId = 1
+let gStarting = false
+const gQueue = [] // worker 还没启动时要发的消息
+
+function post(msg, transfer) {
+  if (!gWorker) {
+    gQueue.push([msg, transfer])
+    return
+  }
+  gWorker.postMessage(msg, transfer || [])
+}
+
+function onMessage(msg) {
+  switch (msg.cmd) {
+    case 'ready':
+      gReady = true
+      for (const cb of gReadyCbs.splice(0)) {
+        setTimeout(cb, 0)
+      }
+      break
+    case 'frames': {
+      const de = gDecoders.get(msg.id)
+      if (de) {
+        de._onFrames(msg.frames, msg.stats)
+      }
+      break
+    }
+    case 'flushed': {
+      const de = gDecoders.get(msg.id)
+      if (de) {
+        de._onFlushed(msg.stats, msg.n)
+      }
+      break
+    }
+    case 'error': {
+      const de = gDecoders.get(msg.id)
+      if (de) {
+        de._onError(msg.message)
+      }
+      break
+    }
+    default:
+      break
+  }
+}
+
+// 启动 worker，url 默认是同目录下的 worker.js
+async function startWorker(url) {
+  url = url || new URL('./worker.js', import.meta.url)
+  if (typeof Worker !== 'undefined') {
+    gWorker = new Worker(url, { type: 'module' })
+    gWorker.onmessage = (e) => onMessage(e.data)
+  } else {
+    const { Worker } = await import('worker_threads')
+    gWorker = new Worker(url)
+    gWorker.on('message', onMessage)
+  }
+  for (const [msg, transfer] of gQueue.splice(0)) {
+    post(msg, transfer)
+  }
+}
+
+// 把 buf 的内存交给 worker，buf 正好占满一个普通的 ArrayBuffer 时直接 transfer，之后调用方不能再用 buf
+// 否则拷贝一份再 transfer
+function transferable(buf) {
+  const isShared = typeof SharedArrayBuffer !== 'undefined' && buf.buffer instanceof SharedArrayBuffer
+  if (!isShared && buf.byteOffset === 0 && buf.byteLength === buf.buffer.byteLength) {
+    return buf.buffer
+  }
+  return buf.slice().buffer
+}
+
+class WorkerDecoder {
+
+  // 启动 worker，url 是 worker.js 的地址，不调用时第一次 setReadyCb 按默认地址启动
+  static start(url) {
+    if (!gStarting) {
+      gStarting = true
+      startWorker(url)
+    }
+  }
+
+  static setLogLevel(level) {
+    WorkerDecoder.start()
+    post({ cmd: 'setLogLevel', level })
+  }
+
+  static setDecodeThreads(n) {
+    WorkerDecoder.start()
+    post({ cmd: 'setDecodeThreads', n })
+  }
+
+  static setConvertThreads(n) {
+    WorkerDecoder.start()
+    post({ cmd: 'setConvertThreads', n })
+  }
+
+  // worker 里的解码器初始化完毕后调用 cb，之后才能创建对象
+  static setReadyCb(cb) {
+    WorkerDecoder.start()
+    if (gReady) {
+      setTimeout(cb, 0)
+    } else {
+      gReadyCbs.push(cb)
+    }
+  }
+
+  static isReady() {
+    return gReady
+  }
+
+  // 参数和 Decoder 一样，opts.zeroCopy 不用，帧本来就是 transfer 过来的
+  // opts.onError: worker 里出错(比如创建解码器失败)时调用 onError(message)，默认打到 console.error
+  // 输出队列在主线程这边：'drop-oldest'/'latest' 时按 queueDepth 丢帧，
+  // 'block' 时不丢，这边攒了 queueDepth 帧没取走 worker 就不再发，帧留在 worker 里，解码也跟着停下来
+  constructor(typ, opts) {
+    if (!gReady) {
+      throw new Error('WorkerDecoder not ready')
+    }
+    opts = opts || {}
+    this._id = gNextId++
+    this._typ = typ
+    this._frames = []
+    this._onFrame = opts.onFrame || null
+    this._onErrorCb = opts.onError || null
+    this._stats = null
+    this._dropped = 0 // 主线程这边队列满了丢掉的帧数
+    this._ackPending = 0 // 取走还没告诉 worker 的帧数
+    this._flushReq = 0
+    this._flushDone = 0
+    this._queueDepth = opts.queueDepth > 0 ? opts.queueDepth : 8
+    this._overflow = opts.overflow || 'block'
+    const workerOpts = Object.assign({}, opts)
+    delete workerOpts.onFrame
+    delete workerOpts.onError
+    delete workerOpts.zeroCopy
+    gDecoders.set(this._id, this)
+    post({ cmd: 'create', id: this._id, typ, opts: workerOpts })
+  }
+
+  _onFrames(frames, stats) {
+    this._stats = stats
+    if (this._onFrame) {
+      for (const frame of frames) {
+        this._onFrame(frame)
+      }
+      this._ack(frames.length)
+      return
+    }
+    for (const frame of frames) {
+      this._frames.push(frame)
+    }
+    const depth = this._overflow === 'latest' ? 1 : this._queueDepth
+    if (this._overflow !== 'block' && this._frames.length > depth) {
+      const n = this._frames.length - depth
+      this._dropped += n
+      this._frames.splice(0, n)
+      this._ack(n)
+    }
+  }
+
+  // 帧离开主线程的队列后还给 worker 额度，同一轮的攒起来发一次
+  _ack(n) {
+    if (n <= 0) {
+      return
+    }
+    const first = this._ackPending === 0
+    this._ackPending += n
+    if (!first) {
+      return
+    }
+    Promise.resolve().then(() => {
+      const n = this._ackPending
+      this._ackPending = 0
+      if (gDecoders.has(this._id)) {
+        post({ cmd: 'ack', id: this._id, n })
+      }
+    })
+  }
+
+  // n 是这次完成的 flush 次数，worker 攒着一起发
+  _onFlushed(stats, n) {
+    if (stats) {
+      this._stats = stats
+    }
+    this._flushDone += n
+  }
+
+  _onError(message) {
+    if (this._onErrorCb) {
+      this._onErrorCb(message)
+      return
+    }
+    console.error('WorkerDecoder', this._typ, message)
+  }
+
+  _call(cmd, args) {
+    if (!gDecoders.has(this._id)) {
+      return
+    }
+    post({ cmd, id: this._id, args })
+  }
+
+  type() {
+    return this._typ
+  }
+
+  // buf 如果正好占满一个 ArrayBuffer 会被 transfer 走，之后不能再用
+  put(buf, pts, dts, opts) {
+    this._put('put', buf, pts, dts, opts)
+  }
+
+  putPacket(buf, pts, dts, opts) {
+    this._put('putPacket', buf, pts, dts, opts)
+  }
+
+  _put(cmd, buf, pts, dts, opts) {
+    if (!gDecoders.has(this._id) || !(buf instanceof Uint8Array)) {
+      return
+    }
+    if (pts !== null && typeof pts === 'object') {
+      opts = pts
+      pts = opts.pts
+      dts = opts.dts
+    }
+    const data = transferable(buf)
+    post({ cmd, id: this._id, buf: data, pts, dts, opts }, [data])
+  }
+
+  flush() {
+    this._flushReq++
+    this._call('flush')
+  }
+
+  flushing() {
+    return this._flushDone !== this._flushReq
+  }
+
+  get() {
+    if (this._frames.length === 0) {
+      return null
+    }
+    this._ack(1)
+    return this._frames.shift()
+  }
+
+  getFrames(max) {
+    const n = max > 0 ? Math.min(max, this._frames.length) : this._frames.length
+    this._ack(n)
+    return this._frames.splice(0, n)
+  }
+
+  // 统计信息是 worker 随帧一起发过来的，是最近一次出帧时的
+  // frameQueue 和 framesDropped 换成主线程这边的，framesDelivered 是 worker 发过来的帧数
+  getStats() {
+    if (!this._stats) {
+      return null
+    }
+    return Object.assign({}, this._stats, {
+      frameQueue: this._frames.length,
+      framesDropped: this._stats.framesDropped + this._dropped
+    })
+  }
+
+  setFrameQueue(depth, overflow) {
+    this._queueDepth = depth > 0 ? depth : 8
+    this._overflow = overflow || 'block'
+    this._call('setFrameQueue', [depth, overflow])
+  }
+
+  setOutputFormat(format) {
+    this._call('setOutputFormat', [format])
+  }
+
+  setOutputSize(width, height, filter) {
+    this._call('setOutputSize', [width, height, filter])
+  }
+
+  setSkipMode(mode) {
+    this._call('setSkipMode', [mode])
+  }
+
+  setSchedule(opts) {
+    this._call('setSchedule', [opts])
+  }
+
+  async dispose() {
+    if (!gDecoders.has(this._id)) {
+      return
+    }
+    this._call('dispose')
+    gDecoders.delete(this._id)
+    this._frames = []
+    this._onFrame = null
+    this._typ = ''
+  }
+
+}
+
+export default WorkerDecoder